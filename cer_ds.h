@@ -3,10 +3,13 @@
 
 #include <ctype.h>
 #include "cer_ds/slice.h"
+#include "cer_ds/arena.h"
 #include "cer_ds/pair.h"
 #include "cer_ds/route.h"
 #include "cer_ds/growable_string.h"
 #include "cer_ds/shashmap.h"
+#include "cer_ds/simd.h"
+#include "cer_ds/needle.h"
 
 #ifndef CERVER_DEBUG
 	#define CERVER_DEBUG 1
@@ -22,15 +25,83 @@
 		}																	\
 	} while(0)
 
+#define REQUEST_ARENA_SIZE 4096	// allocated along with every request, bigger requests spill into more blocks
+#define REQUEST_CACHE_SIZE 16		// finished requests each thread keeps for reuse
+#define REQUEST_RETAIN_LEN (64 * 1024)	// buffers a cached request may keep, larger ones are freed
+#define REQUEST_RETAIN_HEADERS 64	// response header slots a cached request may keep
+
 enum {
 	HTTP_METHOD = 0,
 	HTTP_PATH,
 	HTTP_VERSION,
 	HTTP_HEADER_KEY,
 	HTTP_HEADER_VALUE,
+	HTTP_LINE_END,				// '\r' seen, expecting '\n'
+	HTTP_HEADER_END,			// empty line, expecting '\n'
 	HTTP_BODY,
 };
 
+// Headers the parser indexes while tokenizing, see known_header()
+typedef enum {
+	HEADER_HOST = 0,
+	HEADER_CONTENT_LENGTH,
+	HEADER_CONTENT_TYPE,
+	HEADER_CONNECTION,
+	HEADER_ACCEPT,
+	HEADER_ACCEPT_ENCODING,
+	HEADER_ACCEPT_LANGUAGE,
+	HEADER_COOKIE,
+	HEADER_TRANSFER_ENCODING,
+	HEADER_IF_NONE_MATCH,
+	HEADER_IF_MODIFIED_SINCE,
+	HEADER_IF_RANGE,
+	HEADER_RANGE,
+	HEADER_USER_AGENT,
+	HEADER_EXPECT,
+	HEADER_AUTHORIZATION,
+	HEADER_UPGRADE,
+	HEADER_ORIGIN,
+	HEADER_REFERER,
+	HEADER_COUNT,
+	HEADER_UNKNOWN = HEADER_COUNT,
+} KnownHeader;
+
+// Methods routes are registered for, see parse_method()
+typedef enum {
+	METHOD_GET = 0,
+	METHOD_HEAD,
+	METHOD_POST,
+	METHOD_PUT,
+	METHOD_DELETE,
+	METHOD_PATCH,
+	METHOD_OPTIONS,
+	METHOD_CONNECT,
+	METHOD_TRACE,
+	METHOD_COUNT,
+	METHOD_UNKNOWN = METHOD_COUNT,
+} HttpMethod;
+
+// Parts of the request parsed on first access, see request_query() and request_form()
+typedef enum {
+	REQUEST_PARSED_QUERY = 1 << 0,
+	REQUEST_PARSED_BODY = 1 << 1,
+} RequestParsed;
+
+// Resumable parser state, offsets are relative to the buffer the request is read into
+typedef struct {
+	int state;
+	size_t pos;					// bytes already scanned
+	size_t start;				// current token
+	size_t key_end;
+	size_t value;
+	const char *base;			// buffer address of the last run, the parsed slices are rebased when it moves
+
+	size_t header_len;
+	size_t content_length;
+	bool stream;				// the route reads the body itself, only the head is buffered
+	int error;					// status of a rejected head, given again when the parse is resumed
+} RequestParser;
+
 typedef Pairs Header;
 typedef Pairs QueryParameter;
 typedef Pairs PathParameter;
@@ -50,41 +121,94 @@ typedef struct {
 
 	size_t nkeys;
 	size_t capacity;
+	Arena *arena;
 } MultipartForm;
 
 typedef struct {
 	Slice method;
 	Slice path;
 	Slice http_version;
+	HttpMethod method_type;		// METHOD_UNKNOWN for methods no route can be registered for
 
 	Header headers;
+	unsigned short known_headers[HEADER_COUNT];	// index + 1 of the first such header in `headers`, 0 if missing
 	Slice body;
+	Slice query;				// raw query string
+	unsigned char parsed;		// RequestParsed flags
 
 	QueryParameter query_parameters;
 	PathParameter path_parameters;
 	FormValue form_values;
 	MultipartForm multipart_form;
 
-	GString arena;
+	RequestParser parser;
+	GString arena;				// raw request bytes
+	Arena mem;					// pairs and forms of the request, see new_request()
 } Request;
 
+// A read-only buffer kept alive by its owner, e.g. a cached file, released once it was sent
+typedef struct {
+	Slice data;
+	void *owner;
+	void (*release)(void *owner);
+} SharedBody;
+
 typedef struct {
 	SHashMap headers;
 	GString body;
+	SharedBody shared;			// sent after body without being copied
+
+	int file;					// sent with sendfile after the body if file_len > 0, closed with the response
+	size_t file_offset;
+	size_t file_len;
 } Response;
 
+typedef struct Connection Connection;
 typedef struct {
 	int client;
 
 	int status_code;
 	Request *request;
 	Response *response;
+
+	Connection *conn;			// streaming routes: where read_body() takes the rest of the body from
+	size_t body_left;
+	int body_timeout;			// seconds read_body() waits for the next bytes
+	int body_error;				// 400 or 408 once read_body() failed, later reads fail right away
 } Context;
 
 typedef int (*Callback)(Context*);
+
+typedef enum {
+	CERVER_THREAD_PER_CONNECTION = 0,
+	CERVER_EVENT_LOOP,					// non-blocking, edge-triggered epoll (linux only)
+	CERVER_WORKER_POOL,					// fixed number of workers with work-stealing queues (linux only)
+	CERVER_IO_URING,					// completion-based io_uring loop, falls back to thread per connection (linux >= 5.19)
+} CerverMode;
+
+// The routes of one method
+typedef struct {
+	RouteNode *root;
+	RouteTable table;					// `root` frozen by run()
+	FlatRoute fallback;					// registered for the method alone, answers the paths no route matches
+} MethodRoutes;
+
+typedef struct WorkerPool WorkerPool;
 typedef struct {
 	int server;
-	RouteNode *route;
+	MethodRoutes routes[METHOD_COUNT];
+	StaticRoutes static_routes;			// routes without named or wildcard segments, frozen by run()
+	CerverMode mode;
+
+	size_t nlisteners;					// event loop: > 1 opens that many SO_REUSEPORT sockets, one pinned loop each
+	bool steer_cpu;						// event loop: keep a connection on the CPU that received it (CBPF), needs nlisteners >= CPUs
+
+	size_t nworkers;					// 0 = one worker per online core
+	WorkerPool *pool;
+
+	int keep_alive_timeout;				// seconds a persistent connection may stay idle, 0 = default
+	size_t max_requests;				// requests served per connection, 0 = default
+	size_t max_body_size;				// bytes of a buffered request body, larger ones get 413, 0 = default
 } Cerver;
 
 typedef struct {
@@ -92,6 +216,44 @@ typedef struct {
 	int client;
 } ThreadInfo;
 
+typedef enum {
+	CONNECTION_READING = 0,
+	CONNECTION_WRITING,
+} ConnectionState;
+
+struct Connection {
+	int client;
+	ConnectionState state;
+	bool keep_alive;
+	bool eof;
+	bool detach;				// event loops: the next request goes to a streaming route, it is served on a thread
+	bool draining;				// event loops: half-closed after the last response, the input is dropped until the client closes
+	size_t nrequests;
+
+	Request *request;			// request whose head is being parsed from input
+	GString input;				// bytes received but not consumed by a request yet
+	GString output;				// serialized responses waiting to be sent
+	GString body;				// large body of the last response, sent from its own buffer after output
+	SharedBody shared;			// shared body of the last response, sent after body
+	size_t output_sent;			// bytes of output + body + shared already sent
+	int file;					// file of the last response, sent after body
+	size_t file_offset;
+	size_t file_len;			// bytes of the file still to send
+
+	bool recv_armed;			// io_uring: operations the kernel still holds a reference to
+	bool send_armed;
+	bool read_armed;
+	bool closing;
+#ifdef linux
+	struct iovec iov[3];		// io_uring: the sendmsg in flight
+	struct msghdr msg;
+#endif
+
+	long long last_active;		// event loop: idle list ordered by last activity
+	Connection *prev;
+	Connection *next;
+};
+
 FormFile find_key_in_multipart_form(MultipartForm *mtform, Slice key) {
 	size_t needle_idx = find_slice_in_slices(mtform->keys, mtform->nkeys, key);
 	if (needle_idx < mtform->nkeys) {
@@ -101,37 +263,159 @@ FormFile find_key_in_multipart_form(MultipartForm *mtform, Slice key) {
 	return (FormFile) {0};
 }
 
+// A request, the context answering it and the first block of its arena, allocated and recycled together
+typedef struct {
+	Request request;
+	Context context;
+	Response response;
+	_Alignas(ARENA_ALIGN) char arena[REQUEST_ARENA_SIZE];
+} RequestBlock;
+
+// Finished requests kept by each thread, their buffers are reused by the next requests
+typedef struct {
+	RequestBlock *blocks[REQUEST_CACHE_SIZE];
+	size_t len;
+} RequestCache;
+
+_Thread_local RequestCache request_cache;
+
+void close_file(int *file, size_t *file_len) {
+	if (*file_len > 0) {
+#ifdef linux
+		close(*file);
+#endif
+		*file_len = 0;
+	}
+}
+
+void release_shared_body(SharedBody *shared) {
+	if (shared->release != NULL) {
+		shared->release(shared->owner);
+	}
+	*shared = (SharedBody) {0};
+}
+
+// Frees what the response owns, not the response itself
+void free_response(Response *resp) {
+	shashmap_free(&resp->headers);
+	gstr_free(&resp->body);
+	release_shared_body(&resp->shared);
+	close_file(&resp->file, &resp->file_len);
+}
+
+// Keeps a buffer for the next request unless it grew past REQUEST_RETAIN_LEN
+void trim_gstr(GString *gs) {
+	if (gs->capacity > REQUEST_RETAIN_LEN || gs->mapped) {
+		gstr_free(gs);
+	}
+	gstr_clear(gs);
+}
+
+/*
+ * The request comes with its context, response and REQUEST_ARENA_SIZE bytes of arena for the header,
+ * parameter and form pairs. Blocks are taken from this thread's cache first, so on a busy thread the
+ * raw request buffer, the response headers and body keep the capacity of previous requests.
+ */
+Request *new_request(void) {
+	RequestBlock *block = NULL;
+	if (request_cache.len > 0) {
+		block = request_cache.blocks[--request_cache.len];
+	}
+	else {
+		block = malloc(sizeof(RequestBlock));
+		if (block == NULL) {
+			return NULL;
+		}
+		block->request.arena = (GString) {0};
+		block->response = (Response) {0};
+	}
+
+	Request *req = &block->request;
+	GString raw = req->arena;
+	memset(req, 0, sizeof(Request));
+	req->arena = raw;
+	arena_init(&req->mem, block->arena, REQUEST_ARENA_SIZE);
+	req->headers.arena = &req->mem;
+	req->query_parameters.arena = &req->mem;
+	req->path_parameters.arena = &req->mem;
+	req->form_values.arena = &req->mem;
+	req->multipart_form.arena = &req->mem;
+	return req;
+}
+
+// The context and response that come with `req`, cleared
+Context *request_context(Request *req) {
+	RequestBlock *block = (RequestBlock*) req;
+	memset(&block->context, 0, sizeof(Context));
+	block->context.request = req;
+	block->context.response = &block->response;
+	return &block->context;
+}
+
+// Returns the request, its context and response to this thread's cache, or frees them if it is full
 void free_request(Request *req) {
-	free(req->headers.keys);
-	free(req->headers.values);
-	free(req->query_parameters.keys);
-	free(req->query_parameters.values);
-	free(req->path_parameters.keys);
-	free(req->path_parameters.values);
-	free(req->form_values.keys);
-	free(req->form_values.values);
-	free(req->multipart_form.keys);
+	free_pairs(&req->headers);
+	free_pairs(&req->query_parameters);
+	free_pairs(&req->path_parameters);
+	free_pairs(&req->form_values);
 	for (size_t i = 0; i < req->multipart_form.nkeys; i++) {
 		FormFile ff = req->multipart_form.form_files[i];
-		free(ff.pairs->keys);
-		free(ff.pairs->values);
-		free(ff.pairs);
+		free_pairs(ff.pairs);
+		if (req->multipart_form.arena == NULL) {
+			free(ff.pairs);
+		}
+	}
+	if (req->multipart_form.arena == NULL) {
+		free(req->multipart_form.keys);
+		free(req->multipart_form.form_files);
+	}
+	arena_free(&req->mem);
+
+	RequestBlock *block = (RequestBlock*) req;
+	if (request_cache.len < REQUEST_CACHE_SIZE) {
+		trim_gstr(&req->arena);
+		trim_gstr(&block->response.body);
+		release_shared_body(&block->response.shared);
+		close_file(&block->response.file, &block->response.file_len);
+		if (block->response.headers.capacity > REQUEST_RETAIN_HEADERS) {
+			shashmap_free(&block->response.headers);
+		}
+		shashmap_clear(&block->response.headers);
+		request_cache.blocks[request_cache.len++] = block;
+		return;
 	}
-	free(req->multipart_form.form_files);
+
 	gstr_free(&req->arena);
-	free(req);
+	free_response(&block->response);
+	free(block);
 }
 
-void free_response(Response *resp) {
-	shashmap_free(&resp->headers);
-	free(resp->body.ptr);
-	free(resp);
+// Frees the requests cached by the calling thread, before it exits
+void free_request_cache(void) {
+	while (request_cache.len > 0) {
+		RequestBlock *block = request_cache.blocks[--request_cache.len];
+		gstr_free(&block->request.arena);
+		free_response(&block->response);
+		free(block);
+	}
+}
+
+// Frees what the connection owns, not the connection itself
+void free_connection(Connection *conn) {
+	if (conn->request != NULL) {
+		free_request(conn->request);
+		conn->request = NULL;
+	}
+	gstr_free(&conn->input);
+	gstr_free(&conn->output);
+	gstr_free(&conn->body);
+	release_shared_body(&conn->shared);
+	close_file(&conn->file, &conn->file_len);
 }
 
+// The context and its response come with the request, releasing the request releases them
 void free_context(Context *ctx) {
 	free_request(ctx->request);
-	free_response(ctx->response);
-	free(ctx);
 }
 
 #endif // CER_DS_H
@@ -0,0 +1,124 @@
+#ifndef CER_DS_ARENA_H
+#define CER_DS_ARENA_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+#define ARENA_BLOCK_SIZE 4096
+
+typedef struct ArenaBlock {
+	struct ArenaBlock *next;
+	size_t capacity;
+	char data[];
+} ArenaBlock;
+
+/*
+ * Bump allocator: allocations are carved out of the current block and only released all at once by
+ * arena_reset/arena_free. The first block is a buffer owned by the caller (e.g. placed right after the
+ * struct it serves), blocks malloc'd when it runs out are freed on reset.
+ */
+typedef struct {
+	char *ptr;				// current block
+	size_t len;
+	size_t capacity;
+	char *last;				// most recent allocation, the only one that can grow in place
+
+	char *buffer;			// initial block
+	size_t buffer_capacity;
+	ArenaBlock *blocks;		// overflow blocks, most recent first
+} Arena;
+
+size_t arena_align(size_t n) {
+	return (n + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+}
+
+void arena_init(Arena *a, void *buffer, size_t capacity) {
+	*a = (Arena) {
+		.ptr = buffer,
+		.capacity = capacity,
+		.buffer = buffer,
+		.buffer_capacity = capacity,
+	};
+}
+
+void *arena_alloc(Arena *a, size_t size) {
+	size = arena_align(size);
+	if (size > a->capacity - a->len) {
+		size_t capacity = a->capacity * 2;
+		if (capacity < ARENA_BLOCK_SIZE) {
+			capacity = ARENA_BLOCK_SIZE;
+		}
+		if (capacity < size) {
+			capacity = size;
+		}
+
+		ArenaBlock *block = malloc(sizeof(ArenaBlock) + capacity);
+		if (block == NULL) {
+			return NULL;
+		}
+		block->next = a->blocks;
+		block->capacity = capacity;
+		a->blocks = block;
+		a->ptr = block->data;
+		a->len = 0;
+		a->capacity = capacity;
+	}
+
+	a->last = a->ptr + a->len;
+	a->len += size;
+	return a->last;
+}
+
+void *arena_calloc(Arena *a, size_t n, size_t size) {
+	if (a == NULL) {
+		return calloc(n, size);
+	}
+	if (size != 0 && n > (size_t) -1 / size) {
+		return NULL;
+	}
+
+	void *ptr = arena_alloc(a, n * size);
+	if (ptr != NULL) {
+		memset(ptr, 0, n * size);
+	}
+	return ptr;
+}
+
+// realloc() for a NULL arena, otherwise grows the last allocation in place or copies to a new one
+void *arena_realloc(Arena *a, void *ptr, size_t old_size, size_t new_size) {
+	if (a == NULL) {
+		return realloc(ptr, new_size);
+	}
+
+	if (ptr != NULL && ptr == a->last && arena_align(new_size) <= a->capacity - (a->last - a->ptr)) {
+		a->len = (a->last - a->ptr) + arena_align(new_size);
+		return ptr;
+	}
+
+	void *new_ptr = arena_alloc(a, new_size);
+	if (new_ptr != NULL && ptr != NULL) {
+		memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+	}
+	return new_ptr;
+}
+
+// Frees the overflow blocks and starts over from the initial buffer
+void arena_reset(Arena *a) {
+	while (a->blocks != NULL) {
+		ArenaBlock *next = a->blocks->next;
+		free(a->blocks);
+		a->blocks = next;
+	}
+	a->ptr = a->buffer;
+	a->len = 0;
+	a->capacity = a->buffer_capacity;
+	a->last = NULL;
+}
+
+void arena_free(Arena *a) {
+	arena_reset(a);
+}
+
+#endif // CER_DS_ARENA_H
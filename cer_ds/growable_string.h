@@ -6,13 +6,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include "slice.h"
+#ifdef linux
+	#include <sys/mman.h>
+#endif
 
 #define MAX_CSTRING_LEN 10240
+#define GSTR_MMAP_THRESHOLD (1 << 20)	// exact reservations from this size are mapped instead of malloc'd
+#define GSTR_HUGE_PAGE (1 << 21)
 
 typedef struct {
 	char *ptr;
 	size_t len;
 	size_t capacity;
+	bool mapped;		// ptr comes from mmap
 } GString;
 
 bool gstr_empty(const GString *gs) {
@@ -32,27 +38,53 @@ char gstr_pop(GString *gs) {
 }
 
 void gstr_free(GString *gs) {
+#ifdef linux
+	if (gs->mapped) {
+		munmap(gs->ptr, gs->capacity);
+	}
+	else
+#endif
 	free(gs->ptr);
 	gs->ptr = NULL;
 	gs->len = 0;
 	gs->capacity = 0;
+	gs->mapped = false;
 }
 
-bool gstr_reserve(GString *gs, size_t additional) {
-	size_t new_len = gs->len + additional;
-	if (new_len < gs->capacity) {
-		return true;
-	}
+// Moves the content to a buffer of `new_cap` bytes, mapped straight from the kernel if `map`
+bool gstr_resize(GString *gs, size_t new_cap, bool map) {
+	char *ptr = NULL;
+#ifdef linux
+	if (map || gs->mapped) {
+		bool mapped = false;
+		if (map) {
+			// whole huge pages, so the kernel can back the buffer with them
+			new_cap = (new_cap + GSTR_HUGE_PAGE - 1) & ~((size_t) GSTR_HUGE_PAGE - 1);
+			ptr = mmap(NULL, new_cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			mapped = ptr != MAP_FAILED;
+	#ifdef MADV_HUGEPAGE
+			if (mapped) {
+				madvise(ptr, new_cap, MADV_HUGEPAGE);
+			}
+	#endif
+		}
+		if (!mapped) {
+			ptr = malloc(new_cap);
+			if (ptr == NULL) {
+				return false;
+			}
+		}
 
-	size_t new_cap = gs->capacity * 2;
-	if (new_cap <= new_len) {
-		new_cap = new_len + 1;
-	}
-	if (new_cap <= new_len) {
-		return false;
+		size_t len = gs->len;
+		if (len > 0) {
+			memcpy(ptr, gs->ptr, len);
+		}
+		gstr_free(gs);
+		*gs = (GString) { .ptr = ptr, .len = len, .capacity = new_cap, .mapped = mapped };
+		return true;
 	}
+#endif
 
-	char *ptr = NULL;
    	if (gs->capacity > 0) {
 		ptr = realloc(gs->ptr, new_cap);
 	}
@@ -70,6 +102,39 @@ bool gstr_reserve(GString *gs, size_t additional) {
 	return true;
 }
 
+bool gstr_reserve(GString *gs, size_t additional) {
+	size_t new_len = gs->len + additional;
+	if (new_len < gs->capacity) {
+		return true;
+	}
+
+	size_t new_cap = gs->capacity * 2;
+	if (new_cap <= new_len) {
+		new_cap = new_len + 1;
+	}
+	if (new_cap <= new_len) {
+		return false;
+	}
+
+	return gstr_resize(gs, new_cap, false);
+}
+
+/*
+ * Grows the buffer to exactly `additional` more bytes when the final size is known, e.g. a request once its
+ * Content-Length is parsed. From GSTR_MMAP_THRESHOLD the buffer is mapped (with huge pages when possible).
+ */
+bool gstr_reserve_exact(GString *gs, size_t additional) {
+	size_t new_len = gs->len + additional;
+	if (new_len < gs->capacity) {
+		return true;
+	}
+	if (new_len + 1 <= new_len) {
+		return false;
+	}
+
+	return gstr_resize(gs, new_len + 1, new_len + 1 >= GSTR_MMAP_THRESHOLD);
+}
+
 size_t cstrlen(const char *cstr) {
 	size_t len = 0;
 	while (len < MAX_CSTRING_LEN && *cstr != '\0') {
@@ -0,0 +1,54 @@
+#ifndef CER_DS_NEEDLE_H
+#define CER_DS_NEEDLE_H
+
+#include <stdlib.h>
+#include "slice.h"
+
+#define NEEDLE_INLINE_LEN 80	// "\r\n--" + the longest boundary RFC 2046 allows
+
+/*
+ * A pattern prepared once and searched many times, e.g. the multipart delimiter "\r\n--<boundary>"
+ * over a large body. Short patterns are kept inline, so a needle must not be copied after needle_init.
+ */
+typedef struct {
+	Slice pattern;
+	char *heap;
+	char inline_buffer[NEEDLE_INLINE_LEN];
+} Needle;
+
+// The pattern is `prefix` followed by `s`
+bool needle_init(Needle *n, Slice prefix, Slice s) {
+	size_t len = prefix.len + s.len;
+	char *buffer = n->inline_buffer;
+	n->heap = NULL;
+	if (len > NEEDLE_INLINE_LEN) {
+		n->heap = malloc(len);
+		if (n->heap == NULL) {
+			n->pattern = (Slice) {0};
+			return false;
+		}
+		buffer = n->heap;
+	}
+
+	if (prefix.len > 0) {
+		memcpy(buffer, prefix.ptr, prefix.len);
+	}
+	if (s.len > 0) {
+		memcpy(buffer + prefix.len, s.ptr, s.len);
+	}
+	n->pattern = (Slice) { .ptr = buffer, .len = len };
+	return true;
+}
+
+void needle_free(Needle *n) {
+	free(n->heap);
+	n->heap = NULL;
+	n->pattern = (Slice) {0};
+}
+
+// One forward pass: the SIMD filter only stops where the first and last byte of the pattern both match
+const char *needle_find(const Needle *n, Slice haystack) {
+	return slice_slice(haystack, n->pattern);
+}
+
+#endif // CER_DS_NEEDLE_H
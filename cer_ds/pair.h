@@ -2,12 +2,14 @@
 #define CER_DS_PAIR_H
 
 #include "slice.h"
+#include "arena.h"
 
 typedef struct {
 	Slice *keys;
 	Slice *values;
 	size_t len;
 	size_t capacity;
+	Arena *arena;		// keys and values are allocated from it if set, from the heap otherwise
 } Pairs;
 
 Slice find_key_in_pairs(const Pairs *pairs, Slice key) {
@@ -30,12 +32,12 @@ bool append_pair(Pairs *pairs, Slice key, Slice value) {
 			return false;
 		}
 
-		Slice *new_keys = realloc(pairs->keys, new_cap*sizeof(Slice));
+		Slice *new_keys = arena_realloc(pairs->arena, pairs->keys, pairs->capacity*sizeof(Slice), new_cap*sizeof(Slice));
 		if (new_keys == NULL) {
 			return false;
 		}
 		pairs->keys = new_keys;
-		Slice *new_values = realloc(pairs->values, new_cap*sizeof(Slice));
+		Slice *new_values = arena_realloc(pairs->arena, pairs->values, pairs->capacity*sizeof(Slice), new_cap*sizeof(Slice));
 		if (new_values == NULL) {
 			return false;
 		}
@@ -50,4 +52,14 @@ bool append_pair(Pairs *pairs, Slice key, Slice value) {
 	return true;
 }
 
+// Frees heap backed keys and values, arena backed ones go with their arena
+void free_pairs(Pairs *pairs) {
+	if (pairs->arena == NULL) {
+		free(pairs->keys);
+		free(pairs->values);
+	}
+	pairs->keys = pairs->values = NULL;
+	pairs->len = pairs->capacity = 0;
+}
+
 #endif // CER_DS_PAIR_H
@@ -1,6 +1,7 @@
 #ifndef CER_DS_ROUTE_H
 #define CER_DS_ROUTE_H
 
+#include <stdint.h>
 #include <stdio.h>
 #include "pair.h"
 
@@ -21,6 +22,10 @@ struct RouteNode {
 	size_t capacity;
 	void *callback;
 	RouteNodeType type;
+	bool stream;		// the callback reads the request body with read_body()
+
+	uint32_t params;	// named segments of the route, set while freezing, see RouteTable.params
+	uint32_t nparams;
 };
 
 RouteNode *create_route(Slice slice, RouteNodeType type) {
@@ -72,7 +77,7 @@ RouteNode *find_dynamic_route(RouteNode *root, const char *route, Pairs *matches
 				append_pair(matches, (Slice) {}, slice);
 			}
 
-			size_t matches_len = matches->len;
+			size_t matches_len = matches != NULL ? matches->len : 0;
 			for (size_t i = iter->nnormal; i < iter->nnormal + iter->nnamed; i++) {
 				if (matches != NULL && matches->len > 0) {
 					matches->keys[matches_len - 1] = iter->children[i]->label;
@@ -87,7 +92,9 @@ RouteNode *find_dynamic_route(RouteNode *root, const char *route, Pairs *matches
 				}
 			}
 
-			matches->len--;
+			if (matches != NULL) {
+				matches->len--;
+			}
 			if (iter->children[iter->nchildren - 1]->type == ROUTENODE_WILDCARD) {
 				RouteNode *last_child = iter->children[iter->nchildren - 1];
 				if (*peek == '\0' && last_child->nchildren == 0) {
@@ -130,6 +137,30 @@ RouteNode *find_child_node(RouteNode *root, size_t start, size_t len, Slice labe
 	return NULL;
 }
 
+// The node registered for `route` itself, its ":name" and "*" segments are compared as written
+RouteNode *find_exact_route(RouteNode *root, const char *route) {
+	RouteNode *iter = root;
+	route += strspn(route, "/");
+	while (iter != NULL && *route != '\0') {
+		size_t slash_idx = strcspn(route, "/");
+		Slice slice = (Slice) { .ptr = route, .len = slash_idx };
+		if (slice.ptr[0] == ':') {
+			iter = find_child_node(iter, iter->nnormal, iter->nnamed, slice_advanced(slice, 1));
+		}
+		else if (slice.len == 1 && slice.ptr[0] == '*') {
+			bool has_wildcard = iter->nchildren > iter->nnormal + iter->nnamed;
+			iter = has_wildcard ? iter->children[iter->nchildren - 1] : NULL;
+		}
+		else {
+			iter = find_child_node(iter, 0, iter->nnormal, slice);
+		}
+		route += slash_idx;
+		route += strspn(route, "/");
+	}
+
+	return iter;
+}
+
 bool contains_dynamic_node(const char *route) {
 	while (*route != '\0') {
 		size_t slash_idx = strcspn(route, "/");
@@ -162,8 +193,11 @@ size_t count_dynamic_nodes(const char *route) {
 }
 
 RouteNode *add_route(RouteNode *root, const char *route, void *callback) {
-	if (contains_dynamic_node(route) && find_route(root, route) != NULL) {
-		return NULL;
+	if (contains_dynamic_node(route)) {
+		RouteNode *existing = find_route(root, route);
+		if (existing != NULL && existing->callback != NULL) {
+			return NULL;
+		}
 	}
 
 	bool is_init = false;
@@ -276,6 +310,683 @@ void free_routes(RouteNode *root) {
 	free(root);
 }
 
+#define ROUTE_NONE UINT32_MAX
+#define ROUTE_MAX_STATES (1 << 16)	// overlapping dynamic routes multiply states, freezing fails past this
+
+/*
+ * The routes frozen for lookup, a deterministic automaton over path segments. A state stands for the trie
+ * nodes the segments so far lead to, in priority order: at the first segment where two routes differ, a
+ * static segment beats a named one, which beats a wildcard. A path is matched in one pass, one transition
+ * per segment and no backtracking.
+ *
+ * States and edges are kept in flat arrays: the static edges of a state are adjacent and sorted for a
+ * binary search, first byte first. Chains of states with a single edge are merged into one "a/b/c" edge
+ * and labels are interned in one buffer.
+ */
+typedef struct {
+	uint32_t label;			// offset in RouteTable.labels
+	uint32_t label_len;
+	uint32_t first_len;		// length of the first segment of the label
+	uint32_t target;
+} RouteEdge;
+
+typedef struct {
+	uint32_t segment;		// index of the path segment
+	uint32_t label;			// parameter name, offset in RouteTable.labels
+	uint32_t label_len;
+} RouteParam;
+
+typedef struct {
+	uint32_t edges;			// first static edge
+	uint32_t nedges;
+	uint32_t other;			// state for any other segment, ROUTE_NONE if there is none
+	uint32_t params;		// named segments of the route that ends here
+	uint32_t nparams;
+	bool stream;
+	void *callback;			// NULL if no route ends here
+} FlatRoute;
+
+typedef struct {
+	FlatRoute *nodes;
+	size_t len;
+	RouteEdge *edges;
+	unsigned char *first;	// first label byte of each edge, compared before the label
+	size_t nedges;
+	RouteParam *params;
+	size_t nparams;
+	char *labels;
+	size_t labels_len;
+} RouteTable;
+
+// Scratch space of freeze_routes()
+typedef struct {
+	RouteTable *t;
+	size_t labels_cap, params_cap;
+
+	FlatRoute *states;			// edges and `other` refer to scratch states until the table is laid out
+	size_t nstates, states_cap;
+	size_t *members;			// where the trie nodes of each state start in `pool`
+	size_t members_cap;
+	RouteNode **pool;
+	size_t pool_len, pool_cap;
+	uint32_t *memo;				// states by their trie nodes, open addressing
+	size_t memo_cap;
+	RouteEdge *edges;
+	size_t nedges, edges_cap;
+
+	RouteNode **list;			// trie nodes of the next state
+	size_t list_len, list_cap;
+	Slice *static_labels;		// labels leaving the current state
+	size_t nstatic_labels, static_labels_cap;
+	char *buffer;				// merged labels
+	size_t buffer_cap;
+} RouteFreezer;
+
+bool route_reserve(void *ptr, size_t *capacity, size_t len, size_t size) {
+	if (len <= *capacity) {
+		return true;
+	}
+
+	size_t new_cap = *capacity*2 > len ? *capacity*2 : len;
+	void *new_ptr = realloc(*(void**) ptr, new_cap*size);
+	if (new_ptr == NULL) {
+		return false;
+	}
+	*(void**) ptr = new_ptr;
+	*capacity = new_cap;
+	return true;
+}
+
+int compare_route_labels(const void *a, const void *b) {
+	Slice la = *(const Slice*) a, lb = *(const Slice*) b;
+	int first_a = la.len > 0 ? (unsigned char) la.ptr[0] : -1;
+	int first_b = lb.len > 0 ? (unsigned char) lb.ptr[0] : -1;
+	if (first_a != first_b) {
+		return first_a - first_b;
+	}
+
+	int cmp = memcmp(la.ptr, lb.ptr, la.len < lb.len ? la.len : lb.len);
+	return cmp != 0 ? cmp : (la.len > lb.len) - (la.len < lb.len);
+}
+
+// Offset of `label` in the table's buffer, appended unless it is already there
+bool intern_route_label(RouteFreezer *f, Slice label, uint32_t *offset) {
+	RouteTable *t = f->t;
+	const char *found = slice_slice((Slice) { .ptr = t->labels, .len = t->labels_len }, label);
+	if (found != NULL && label.len > 0) {
+		*offset = found - t->labels;
+		return true;
+	}
+	if (t->labels_len + label.len > UINT32_MAX || !route_reserve(&t->labels, &f->labels_cap, t->labels_len + label.len + 1, 1)) {
+		return false;
+	}
+
+	if (label.len > 0) {
+		memcpy(t->labels + t->labels_len, label.ptr, label.len);
+	}
+	*offset = t->labels_len;
+	t->labels_len += label.len;
+	return true;
+}
+
+// Records the named segments of every route under `n`, `stack` holds those of its ancestors
+bool collect_route_params(RouteFreezer *f, RouteNode *n, uint32_t depth, RouteParam *stack, uint32_t nstack) {
+	RouteTable *t = f->t;
+	if (n->type == ROUTENODE_NAMED && depth > 0) {
+		stack[nstack].segment = depth - 1;
+		if (!intern_route_label(f, n->label, &stack[nstack].label)) {
+			return false;
+		}
+		stack[nstack++].label_len = n->label.len;
+	}
+
+	n->params = t->nparams;
+	n->nparams = n->callback != NULL ? nstack : 0;
+	if (n->nparams > 0) {
+		if (!route_reserve(&t->params, &f->params_cap, t->nparams + nstack, sizeof(RouteParam))) {
+			return false;
+		}
+		memcpy(t->params + t->nparams, stack, nstack*sizeof(RouteParam));
+		t->nparams += nstack;
+	}
+
+	for (size_t i = 0; i < n->nchildren; i++) {
+		if (!collect_route_params(f, n->children[i], depth + 1, stack, nstack)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+size_t count_route_nodes(const RouteNode *root) {
+	size_t cnt = 1;
+	for (size_t i = 0; i < root->nchildren; i++) {
+		cnt += count_route_nodes(root->children[i]);
+	}
+
+	return cnt;
+}
+
+size_t route_list_hash(RouteNode **list, size_t len) {
+	size_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ (uintptr_t) list[i]) * 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+bool route_state_is(RouteFreezer *f, uint32_t state, RouteNode **list, size_t len) {
+	size_t end = state + 1 < f->nstates ? f->members[state + 1] : f->pool_len;
+	return end - f->members[state] == len && memcmp(f->pool + f->members[state], list, len*sizeof(RouteNode*)) == 0;
+}
+
+void route_memo_insert(RouteFreezer *f, uint32_t state, size_t hash) {
+	size_t i = hash & (f->memo_cap - 1);
+	while (f->memo[i] != ROUTE_NONE) {
+		i = (i + 1) & (f->memo_cap - 1);
+	}
+	f->memo[i] = state;
+}
+
+// The state standing for the trie nodes in f->list, created on first sight. ROUTE_NONE on failure
+uint32_t intern_route_state(RouteFreezer *f) {
+	size_t hash = route_list_hash(f->list, f->list_len);
+	size_t i = hash & (f->memo_cap - 1);
+	for (; f->memo[i] != ROUTE_NONE; i = (i + 1) & (f->memo_cap - 1)) {
+		if (route_state_is(f, f->memo[i], f->list, f->list_len)) {
+			return f->memo[i];
+		}
+	}
+
+	if (f->nstates >= ROUTE_MAX_STATES ||
+		!route_reserve(&f->states, &f->states_cap, f->nstates + 1, sizeof(FlatRoute)) ||
+		!route_reserve(&f->members, &f->members_cap, f->nstates + 1, sizeof(size_t)) ||
+		!route_reserve(&f->pool, &f->pool_cap, f->pool_len + f->list_len, sizeof(RouteNode*))) {
+		return ROUTE_NONE;
+	}
+	uint32_t state = f->nstates++;
+	f->members[state] = f->pool_len;
+	memcpy(f->pool + f->pool_len, f->list, f->list_len*sizeof(RouteNode*));
+	f->pool_len += f->list_len;
+
+	if (f->nstates*2 > f->memo_cap) {
+		uint32_t *memo = malloc(f->memo_cap*2*sizeof(uint32_t));
+		if (memo == NULL) {
+			return ROUTE_NONE;
+		}
+		free(f->memo);
+		f->memo = memo;
+		f->memo_cap *= 2;
+		memset(f->memo, 0xff, f->memo_cap*sizeof(uint32_t));
+		for (uint32_t s = 0; s < f->nstates; s++) {
+			size_t end = s + 1 < f->nstates ? f->members[s + 1] : f->pool_len;
+			route_memo_insert(f, s, route_list_hash(f->pool + f->members[s], end - f->members[s]));
+		}
+	}
+	else {
+		route_memo_insert(f, state, hash);
+	}
+	return state;
+}
+
+bool push_route_node(RouteFreezer *f, RouteNode *n) {
+	if (!route_reserve(&f->list, &f->list_cap, f->list_len + 1, sizeof(RouteNode*))) {
+		return false;
+	}
+	f->list[f->list_len++] = n;
+	return true;
+}
+
+// Appends the named children of `n`, then its wildcard
+bool push_dynamic_route_nodes(RouteFreezer *f, RouteNode *n) {
+	for (size_t i = n->nnormal; i < n->nchildren; i++) {
+		if (!push_route_node(f, n->children[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Fills the edges and the accepted route of a state
+bool expand_route_state(RouteFreezer *f, uint32_t state) {
+	size_t end = state + 1 < f->nstates ? f->members[state + 1] : f->pool_len;
+	size_t nmembers = end - f->members[state];
+	FlatRoute *s = &f->states[state];
+	*s = (FlatRoute) { .edges = f->nedges, .other = ROUTE_NONE };
+	for (size_t i = 0; i < nmembers; i++) {
+		RouteNode *m = f->pool[f->members[state] + i];
+		if (m->callback != NULL) {
+			s->callback = m->callback;
+			s->stream = m->stream;
+			s->params = m->params;
+			s->nparams = m->nparams;
+			break;
+		}
+	}
+
+	f->nstatic_labels = 0;
+	for (size_t i = 0; i < nmembers; i++) {
+		RouteNode *m = f->pool[f->members[state] + i];
+		if (!route_reserve(&f->static_labels, &f->static_labels_cap, f->nstatic_labels + m->nnormal, sizeof(Slice))) {
+			return false;
+		}
+		for (size_t j = 0; j < m->nnormal; j++) {
+			f->static_labels[f->nstatic_labels++] = m->children[j]->label;
+		}
+	}
+	if (f->nstatic_labels > 1) {
+		qsort(f->static_labels, f->nstatic_labels, sizeof(Slice), compare_route_labels);
+	}
+
+	// each member follows a static label to its child, then any member may take it as a named or wildcard segment
+	for (size_t l = 0; l < f->nstatic_labels; l++) {
+		Slice label = f->static_labels[l];
+		if (l > 0 && slice_equal(label, f->static_labels[l - 1])) {
+			continue;
+		}
+
+		f->list_len = 0;
+		for (size_t i = 0; i < nmembers; i++) {
+			RouteNode *m = f->pool[f->members[state] + i];
+			RouteNode *child = find_child_node(m, 0, m->nnormal, label);
+			if ((child != NULL && !push_route_node(f, child)) || !push_dynamic_route_nodes(f, m)) {
+				return false;
+			}
+		}
+
+		uint32_t target = intern_route_state(f);
+		if (target == ROUTE_NONE || !route_reserve(&f->edges, &f->edges_cap, f->nedges + 1, sizeof(RouteEdge))) {
+			return false;
+		}
+		RouteEdge *e = &f->edges[f->nedges++];
+		*e = (RouteEdge) { .label_len = label.len, .first_len = label.len, .target = target };
+		if (!intern_route_label(f, label, &e->label)) {
+			return false;
+		}
+		f->states[state].nedges++;
+	}
+
+	f->list_len = 0;
+	for (size_t i = 0; i < nmembers; i++) {
+		if (!push_dynamic_route_nodes(f, f->pool[f->members[state] + i])) {
+			return false;
+		}
+	}
+	if (f->list_len > 0) {
+		uint32_t other = intern_route_state(f);
+		if (other == ROUTE_NONE) {
+			return false;
+		}
+		f->states[state].other = other;
+	}
+	return true;
+}
+
+// A state only passed through, its single edge can be merged into the ones leading to it
+bool route_state_mergeable(const FlatRoute *s) {
+	return s->callback == NULL && s->other == ROUTE_NONE && s->nedges == 1;
+}
+
+// Joins the labels of the edge and of the states it merely passes through, "a" + "b" = "a/b"
+bool merge_route_edge(RouteFreezer *f, RouteEdge *e) {
+	size_t len = 0;
+	RouteEdge *iter = e;
+	while (true) {
+		if (!route_reserve(&f->buffer, &f->buffer_cap, len + iter->label_len + 1, 1)) {
+			return false;
+		}
+		if (len > 0) {
+			f->buffer[len++] = '/';
+		}
+		memcpy(f->buffer + len, f->t->labels + iter->label, iter->label_len);
+		len += iter->label_len;
+		if (!route_state_mergeable(&f->states[iter->target])) {
+			break;
+		}
+		iter = &f->edges[f->states[iter->target].edges];
+	}
+
+	e->target = iter->target;
+	e->label_len = len;
+	return len == e->first_len || intern_route_label(f, (Slice) { .ptr = f->buffer, .len = len }, &e->label);
+}
+
+void free_route_table(RouteTable *t) {
+	free(t->nodes);
+	free(t->edges);
+	free(t->first);
+	free(t->params);
+	free(t->labels);
+	*t = (RouteTable) {0};
+}
+
+// Lays out the states reachable once edges are merged, breadth first
+bool layout_route_table(RouteFreezer *f) {
+	RouteTable *t = f->t;
+	uint32_t *ids = malloc(f->nstates*sizeof(uint32_t));
+	uint32_t *order = malloc(f->nstates*sizeof(uint32_t));
+	t->nodes = malloc(f->nstates*sizeof(FlatRoute));
+	t->edges = malloc((f->nedges + 1)*sizeof(RouteEdge));
+	t->first = malloc(f->nedges + 1);
+	bool success = ids != NULL && order != NULL && t->nodes != NULL && t->edges != NULL && t->first != NULL;
+	if (success) {
+		memset(ids, 0xff, f->nstates*sizeof(uint32_t));
+		ids[0] = 0;
+		order[0] = 0;
+		t->len = 1;
+	}
+
+	for (size_t i = 0; success && i < t->len; i++) {
+		FlatRoute *s = &f->states[order[i]];
+		for (size_t e = s->edges; e <= s->edges + s->nedges; e++) {
+			uint32_t target = e < s->edges + s->nedges ? f->edges[e].target : s->other;
+			if (target != ROUTE_NONE && ids[target] == ROUTE_NONE) {
+				ids[target] = t->len;
+				order[t->len++] = target;
+			}
+		}
+
+		FlatRoute *n = &t->nodes[i];
+		*n = *s;
+		n->edges = t->nedges;
+		n->other = s->other != ROUTE_NONE ? ids[s->other] : ROUTE_NONE;
+		for (size_t e = s->edges; e < s->edges + s->nedges; e++) {
+			t->edges[t->nedges] = f->edges[e];
+			t->edges[t->nedges].target = ids[f->edges[e].target];
+			t->first[t->nedges++] = f->edges[e].label_len > 0 ? (unsigned char) t->labels[f->edges[e].label] : 0;
+		}
+	}
+
+	free(ids);
+	free(order);
+	return success;
+}
+
+// Builds the lookup table of the trie, the trie itself is kept for further registrations
+bool freeze_routes(RouteTable *t, RouteNode *root) {
+	free_route_table(t);
+	if (root == NULL) {
+		return true;
+	}
+
+	RouteFreezer f = { .t = t, .memo_cap = 64 };
+	size_t depth = count_route_nodes(root);
+	RouteParam *stack = malloc(depth*sizeof(RouteParam));
+	f.memo = malloc(f.memo_cap*sizeof(uint32_t));
+	bool success = stack != NULL && f.memo != NULL && collect_route_params(&f, root, 0, stack, 0);
+	if (success) {
+		memset(f.memo, 0xff, f.memo_cap*sizeof(uint32_t));
+		success = push_route_node(&f, root) && intern_route_state(&f) == 0;
+	}
+	for (uint32_t i = 0; success && i < f.nstates; i++) {
+		success = expand_route_state(&f, i);
+	}
+	for (size_t e = 0; success && e < f.nedges; e++) {
+		success = merge_route_edge(&f, &f.edges[e]);
+	}
+	success = success && layout_route_table(&f);
+
+	free(stack);
+	free(f.states);
+	free(f.members);
+	free(f.pool);
+	free(f.memo);
+	free(f.edges);
+	free(f.list);
+	free(f.static_labels);
+	free(f.buffer);
+	if (!success) {
+		free_route_table(t);
+	}
+	return success;
+}
+
+size_t skip_slashes(const char *s, const char *end) {
+	const char *p = s;
+	while (p < end && *p == '/') {
+		p += 1;
+	}
+
+	return p - s;
+}
+
+size_t segment_len(const char *s, const char *end) {
+	const char *p = s;
+	while (p < end && *p != '/') {
+		p += 1;
+	}
+
+	return p - s;
+}
+
+// Where the label of `e` ends in the path if it matches up to a segment boundary, a '/' in it matches a run of them
+const char *match_route_label(const RouteTable *t, const RouteEdge *e, const char *path, const char *end) {
+	const char *label = t->labels + e->label;
+	for (size_t i = 0; i < e->label_len; i++) {
+		if (path == end) {
+			return NULL;
+		}
+		if (label[i] == '/' && *path == '/') {
+			path += skip_slashes(path, end);
+		}
+		else if (*path == label[i]) {
+			path += 1;
+		}
+		else {
+			return NULL;
+		}
+	}
+
+	return path == end || *path == '/' ? path : NULL;
+}
+
+// Binary search of the edges of `state` by their first segment, ordered as compare_route_labels()
+const RouteEdge *find_route_edge(const RouteTable *t, const FlatRoute *state, Slice segment) {
+	size_t lo = state->edges, hi = state->edges + state->nedges;
+	unsigned char first = segment.ptr[0];
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo)/2;
+		int cmp = (int) t->first[mid] - first;
+		if (cmp == 0) {
+			const RouteEdge *e = &t->edges[mid];
+			cmp = memcmp(t->labels + e->label, segment.ptr, e->first_len < segment.len ? e->first_len : segment.len);
+			cmp = cmp != 0 ? cmp : (e->first_len > segment.len) - (e->first_len < segment.len);
+		}
+		if (cmp == 0) {
+			return &t->edges[mid];
+		}
+		if (cmp < 0) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	return NULL;
+}
+
+// Runs `path` through the frozen table, the values of the named segments of the route are added to `matches`
+const FlatRoute *find_table_route(const RouteTable *t, Slice path, Pairs *matches) {
+	if (t->len == 0) {
+		return NULL;
+	}
+
+	const FlatRoute *state = &t->nodes[0];
+	const char *route = path.ptr, *end = path.ptr + path.len;
+	route += skip_slashes(route, end);
+	while (route < end) {
+		size_t len = segment_len(route, end);
+		const RouteEdge *edge = find_route_edge(t, state, (Slice) { .ptr = route, .len = len });
+
+		if (edge != NULL) {
+			// the states a merged edge skips have no other way out
+			const char *rest = match_route_label(t, edge, route, end);
+			if (rest == NULL) {
+				return NULL;
+			}
+			state = &t->nodes[edge->target];
+			route = rest;
+		}
+		else if (state->other != ROUTE_NONE) {
+			state = &t->nodes[state->other];
+			route += len;
+		}
+		else {
+			return NULL;
+		}
+		route += skip_slashes(route, end);
+	}
+
+	if (state->callback == NULL) {
+		return NULL;
+	}
+
+	// the route that ends here tells which segments are named
+	const RouteParam *param = t->params + state->params, *last = param + state->nparams;
+	route = path.ptr + skip_slashes(path.ptr, end);
+	for (uint32_t segment = 0; matches != NULL && param < last && route < end; segment++) {
+		size_t len = segment_len(route, end);
+		if (param->segment == segment) {
+			append_pair(matches, (Slice) { .ptr = t->labels + param->label, .len = param->label_len }, (Slice) { .ptr = route, .len = len });
+			param += 1;
+		}
+		route += len;
+		route += skip_slashes(route, end);
+	}
+	return state;
+}
+
+// A route made only of static segments, keyed by method and path
+typedef struct {
+	size_t hash;			// of the method and the path
+	uint32_t path;			// "/a/b", offset in StaticRoutes.paths
+	uint32_t path_len;
+	unsigned method;
+	FlatRoute route;		// callback NULL for an empty slot
+} StaticRoute;
+
+// Exact-match table checked before the automaton, open addressing with linear probing
+typedef struct {
+	StaticRoute *slots;
+	size_t len;
+	size_t capacity;		// power of two, at most half full
+	char *paths;
+	size_t paths_len;
+	size_t paths_cap;
+} StaticRoutes;
+
+// FNV-1a of the method and the path
+size_t static_route_hash(unsigned method, Slice path) {
+	size_t hash = (14695981039346656037ULL ^ method) * 1099511628211ULL;
+	for (size_t i = 0; i < path.len; i++) {
+		hash = (hash ^ (unsigned char) path.ptr[i]) * 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+const FlatRoute *find_static_route(const StaticRoutes *r, unsigned method, Slice path) {
+	if (r->len == 0) {
+		return NULL;
+	}
+
+	size_t hash = static_route_hash(method, path);
+	for (size_t i = hash & (r->capacity - 1); r->slots[i].route.callback != NULL; i = (i + 1) & (r->capacity - 1)) {
+		const StaticRoute *slot = &r->slots[i];
+		if (slot->hash == hash && slot->method == method && slot->path_len == path.len &&
+			memcmp(r->paths + slot->path, path.ptr, path.len) == 0) {
+			return &slot->route;
+		}
+	}
+	return NULL;
+}
+
+void insert_static_route(StaticRoutes *r, StaticRoute route) {
+	size_t i = route.hash & (r->capacity - 1);
+	while (r->slots[i].route.callback != NULL) {
+		i = (i + 1) & (r->capacity - 1);
+	}
+	r->slots[i] = route;
+	r->len++;
+}
+
+bool add_static_route(StaticRoutes *r, unsigned method, Slice path, const RouteNode *n) {
+	if ((r->len + 1)*2 > r->capacity) {
+		size_t capacity = r->capacity > 0 ? r->capacity*2 : 16;
+		StaticRoute *slots = calloc(capacity, sizeof(StaticRoute));
+		if (slots == NULL) {
+			return false;
+		}
+
+		StaticRoute *old = r->slots;
+		size_t old_capacity = r->capacity;
+		r->slots = slots;
+		r->capacity = capacity;
+		r->len = 0;
+		for (size_t i = 0; i < old_capacity; i++) {
+			if (old[i].route.callback != NULL) {
+				insert_static_route(r, old[i]);
+			}
+		}
+		free(old);
+	}
+	if (r->paths_len + path.len > UINT32_MAX || !route_reserve(&r->paths, &r->paths_cap, r->paths_len + path.len, 1)) {
+		return false;
+	}
+
+	memcpy(r->paths + r->paths_len, path.ptr, path.len);
+	insert_static_route(r, (StaticRoute) {
+		.hash = static_route_hash(method, path),
+		.path = r->paths_len,
+		.path_len = path.len,
+		.method = method,
+		.route = { .callback = n->callback, .stream = n->stream },
+	});
+	r->paths_len += path.len;
+	return true;
+}
+
+void free_static_routes(StaticRoutes *r) {
+	free(r->slots);
+	free(r->paths);
+	*r = (StaticRoutes) {0};
+}
+
+// Adds the routes under `n` that have no named or wildcard segment, `path` holds the segments leading to it
+bool collect_static_routes(StaticRoutes *r, unsigned method, const RouteNode *n, char **path, size_t *path_cap, size_t len) {
+	if (n->callback != NULL && !add_static_route(r, method, len > 0 ? (Slice) { .ptr = *path, .len = len } : slice_cstr("/"), n)) {
+		return false;
+	}
+
+	for (size_t i = 0; i < n->nnormal; i++) {
+		Slice label = n->children[i]->label;
+		if (!route_reserve(path, path_cap, len + label.len + 1, 1)) {
+			return false;
+		}
+		(*path)[len] = '/';
+		memcpy(*path + len + 1, label.ptr, label.len);
+		if (!collect_static_routes(r, method, n->children[i], path, path_cap, len + label.len + 1)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Puts the static routes of `root` in `r`, alongside those of other methods
+bool freeze_static_routes(StaticRoutes *r, unsigned method, const RouteNode *root) {
+	if (root == NULL) {
+		return true;
+	}
+
+	char *path = NULL;
+	size_t path_cap = 0;
+	bool success = collect_static_routes(r, method, root, &path, &path_cap, 0);
+	free(path);
+	return success;
+}
+
 #define TAB_WIDTH 2
 void print_routes(RouteNode *root, int depth) {
     if (root == NULL) {
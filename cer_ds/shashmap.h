@@ -20,6 +20,7 @@ typedef struct SHashMap {
 	size_t ntombstone;
 	size_t len;
 	size_t capacity;
+	size_t nretained;		// key/value strings kept by shashmap_clear, reused by the next inserts
 } SHashMap;
 
 bool shashmap_empty(const SHashMap *hm) {
@@ -73,7 +74,7 @@ bool shashmap_occupied_slot(SHashMap *hm, size_t slot_idx) {
 }
 
 bool shashmap_rehash(SHashMap *hm) {
-	size_t new_cap = hm->capacity;
+	size_t new_cap = hm->capacity * 2;	// at least double, a cleared map can be at its threshold while empty
 	int iter = 63;
 	while (iter-- > 0 && new_cap <= 2 * (hm->len - hm->ntombstone)) {
 		new_cap = new_cap * 2;
@@ -130,12 +131,19 @@ size_t shashmap_insert(SHashMap *hm, GString *s, GString *v) {
 		bool is_tombstone = hm->link[slot_idx] == SHASHMAP_TOMBSTONE_SLOT;
 		bool is_empty = hm->link[slot_idx] == SHASHMAP_EMPTY_SLOT;
 		if (is_tombstone || is_empty) {
-			GString key = {0}, value = {0};
-			gstr_append_fmt(&key, "%Sg", *s);
-			gstr_append_fmt(&value, "%Sg", *v);
-			hm->key[hm->len] = key;
+			GString *key = &hm->key[hm->len], *value = &hm->value[hm->len];
+			if (hm->len < hm->nretained) {
+				gstr_clear(key);
+				gstr_clear(value);
+			}
+			else {
+				*key = (GString) {0};
+				*value = (GString) {0};
+				hm->nretained = hm->len + 1;
+			}
+			gstr_append_fmt(key, "%Sg", *s);
+			gstr_append_fmt(value, "%Sg", *v);
 			hm->key_hash[hm->len] = key_hash;
-			hm->value[hm->len] = value;
 			hm->link[slot_idx] = hm->len;
 			hm->ntombstone -= is_tombstone;
 			hm->len += is_empty;
@@ -193,19 +201,26 @@ bool shashmap_delete(SHashMap *hm, GString *key) {
 	return true;
 }
 
-void shashmap_free(SHashMap *hm) {
+// Removes every entry but keeps the slots and the key/value strings for reuse
+void shashmap_clear(SHashMap *hm) {
 	for (size_t slot_idx = 0; slot_idx < hm->capacity; slot_idx++) {
-		if (shashmap_occupied_slot(hm, slot_idx)) {
-			size_t idx = hm->link[slot_idx];
-			gstr_free(&hm->key[idx]);
-			gstr_free(&hm->value[idx]);
-		}
+		hm->link[slot_idx] = SHASHMAP_EMPTY_SLOT;
+	}
+	hm->len = 0;
+	hm->ntombstone = 0;
+}
+
+void shashmap_free(SHashMap *hm) {
+	for (size_t idx = 0; idx < hm->nretained; idx++) {
+		gstr_free(&hm->key[idx]);
+		gstr_free(&hm->value[idx]);
 	}
 
 	free(hm->key);
 	free(hm->key_hash);
 	free(hm->value);
 	free(hm->link);
+	*hm = (SHashMap) {0};
 }
 
 #endif // HASHMAP_H
@@ -0,0 +1,331 @@
+#ifndef CER_DS_SIMD_H
+#define CER_DS_SIMD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+	#define CER_DS_SIMD_X86 1
+	#include <immintrin.h>
+#endif
+
+/*
+ * Byte scanning kernels behind the slice functions and the request parser. The widest variant the CPU
+ * supports is picked on first use: AVX2 (32 bytes per step), SSE4.2 (16 bytes) or a plain loop.
+ */
+
+// Index of the first byte of `s` that is one of the `nset` (1 to 3) bytes of `set`, `len` if there is none
+size_t find_any_scalar(const char *s, size_t len, const char *set, int nset) {
+	for (size_t i = 0; i < len; i++) {
+		for (int j = 0; j < nset; j++) {
+			if (s[i] == set[j]) {
+				return i;
+			}
+		}
+	}
+
+	return len;
+}
+
+void lowercase_scalar(char *s, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		if (s[i] >= 'A' && s[i] <= 'Z') {
+			s[i] += 'a' - 'A';
+		}
+	}
+}
+
+char ascii_lower(char c) {
+	return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+bool equal_nocase_scalar(const char *a, const char *b, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		if (ascii_lower(a[i]) != ascii_lower(b[i])) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Letters match either case once this is OR'ed into both sides, other bytes are compared as they are
+unsigned char nocase_fold(char c, bool nocase) {
+	return nocase && ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') ? 0x20 : 0;
+}
+
+// First occurrence of `needle` (at least 2 bytes) in `s`, NULL if there is none
+const char *find_substring_scalar(const char *s, size_t len, const char *needle, size_t nlen, bool nocase) {
+	if (len < nlen) {
+		return NULL;
+	}
+
+	const char *end = s + len - nlen + 1;
+	const char *iter = s;
+	if (!nocase) {
+		while (iter < end) {
+			iter = memchr(iter, needle[0], end - iter);
+			if (iter == NULL) {
+				return NULL;
+			}
+			if (iter[nlen - 1] == needle[nlen - 1] && memcmp(iter + 1, needle + 1, nlen - 2) == 0) {
+				return iter;
+			}
+			iter += 1;
+		}
+		return NULL;
+	}
+
+	char first = ascii_lower(needle[0]), last = ascii_lower(needle[nlen - 1]);
+	for (; iter < end; iter++) {
+		if (ascii_lower(iter[0]) == first && ascii_lower(iter[nlen - 1]) == last &&
+			equal_nocase_scalar(iter + 1, needle + 1, nlen - 2)) {
+			return iter;
+		}
+	}
+
+	return NULL;
+}
+
+#ifdef CER_DS_SIMD_X86
+__attribute__((target("avx2")))
+size_t find_any_avx2(const char *s, size_t len, const char *set, int nset) {
+	__m256i c0 = _mm256_set1_epi8(set[0]);
+	__m256i c1 = _mm256_set1_epi8(set[nset > 1 ? 1 : 0]);
+	__m256i c2 = _mm256_set1_epi8(set[nset > 2 ? 2 : 0]);
+
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*) (s + i));
+		__m256i eq = _mm256_or_si256(_mm256_cmpeq_epi8(v, c0),
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, c1), _mm256_cmpeq_epi8(v, c2)));
+		unsigned mask = (unsigned) _mm256_movemask_epi8(eq);
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+
+	return i + find_any_scalar(s + i, len - i, set, nset);
+}
+
+__attribute__((target("avx2")))
+void lowercase_avx2(char *s, size_t len) {
+	__m256i before_a = _mm256_set1_epi8('A' - 1);
+	__m256i after_z = _mm256_set1_epi8('Z' + 1);
+	__m256i diff = _mm256_set1_epi8('a' - 'A');
+
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*) (s + i));
+		__m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, before_a), _mm256_cmpgt_epi8(after_z, v));
+		v = _mm256_add_epi8(v, _mm256_and_si256(upper, diff));
+		_mm256_storeu_si256((__m256i*) (s + i), v);
+	}
+
+	lowercase_scalar(s + i, len - i);
+}
+
+bool equal_nocase_avx2(const char *a, const char *b, size_t len);
+
+/*
+ * Compares the first and the last byte of the needle against 32 candidate positions at once,
+ * only positions where both match are checked in full.
+ */
+__attribute__((target("avx2")))
+const char *find_substring_avx2(const char *s, size_t len, const char *needle, size_t nlen, bool nocase) {
+	__m256i fold_first = _mm256_set1_epi8(nocase_fold(needle[0], nocase));
+	__m256i fold_last = _mm256_set1_epi8(nocase_fold(needle[nlen - 1], nocase));
+	__m256i first = _mm256_or_si256(_mm256_set1_epi8(needle[0]), fold_first);
+	__m256i last = _mm256_or_si256(_mm256_set1_epi8(needle[nlen - 1]), fold_last);
+
+	size_t i = 0;
+	for (; i + nlen - 1 + 32 <= len; i += 32) {
+		__m256i block_first = _mm256_or_si256(_mm256_loadu_si256((const __m256i*) (s + i)), fold_first);
+		__m256i block_last = _mm256_or_si256(_mm256_loadu_si256((const __m256i*) (s + i + nlen - 1)), fold_last);
+		__m256i eq = _mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last));
+		unsigned mask = (unsigned) _mm256_movemask_epi8(eq);
+		while (mask != 0) {
+			size_t candidate = i + __builtin_ctz(mask);
+			if (nocase ? equal_nocase_avx2(s + candidate, needle, nlen) : memcmp(s + candidate + 1, needle + 1, nlen - 2) == 0) {
+				return s + candidate;
+			}
+			mask &= mask - 1;
+		}
+	}
+
+	return find_substring_scalar(s + i, len - i, needle, nlen, nocase);
+}
+
+__attribute__((target("avx2")))
+bool equal_nocase_avx2(const char *a, const char *b, size_t len) {
+	__m256i before_a = _mm256_set1_epi8('A' - 1);
+	__m256i after_z = _mm256_set1_epi8('Z' + 1);
+	__m256i diff = _mm256_set1_epi8('a' - 'A');
+
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i va = _mm256_loadu_si256((const __m256i*) (a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i*) (b + i));
+		__m256i upper_a = _mm256_and_si256(_mm256_cmpgt_epi8(va, before_a), _mm256_cmpgt_epi8(after_z, va));
+		__m256i upper_b = _mm256_and_si256(_mm256_cmpgt_epi8(vb, before_a), _mm256_cmpgt_epi8(after_z, vb));
+		va = _mm256_add_epi8(va, _mm256_and_si256(upper_a, diff));
+		vb = _mm256_add_epi8(vb, _mm256_and_si256(upper_b, diff));
+		if ((unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != 0xffffffffu) {
+			return false;
+		}
+	}
+
+	return equal_nocase_scalar(a + i, b + i, len - i);
+}
+
+__attribute__((target("sse4.2")))
+size_t find_any_sse42(const char *s, size_t len, const char *set, int nset) {
+	char chars[16] = {0};
+	for (int j = 0; j < nset; j++) {
+		chars[j] = set[j];
+	}
+	__m128i needles = _mm_loadu_si128((const __m128i*) chars);
+
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+		int idx = _mm_cmpestri(needles, nset, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+		if (idx < 16) {
+			return i + idx;
+		}
+	}
+
+	return i + find_any_scalar(s + i, len - i, set, nset);
+}
+
+__attribute__((target("sse4.2")))
+void lowercase_sse42(char *s, size_t len) {
+	__m128i before_a = _mm_set1_epi8('A' - 1);
+	__m128i after_z = _mm_set1_epi8('Z' + 1);
+	__m128i diff = _mm_set1_epi8('a' - 'A');
+
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+		__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, before_a), _mm_cmpgt_epi8(after_z, v));
+		v = _mm_add_epi8(v, _mm_and_si128(upper, diff));
+		_mm_storeu_si128((__m128i*) (s + i), v);
+	}
+
+	lowercase_scalar(s + i, len - i);
+}
+
+bool equal_nocase_sse42(const char *a, const char *b, size_t len);
+
+__attribute__((target("sse4.2")))
+const char *find_substring_sse42(const char *s, size_t len, const char *needle, size_t nlen, bool nocase) {
+	__m128i fold_first = _mm_set1_epi8(nocase_fold(needle[0], nocase));
+	__m128i fold_last = _mm_set1_epi8(nocase_fold(needle[nlen - 1], nocase));
+	__m128i first = _mm_or_si128(_mm_set1_epi8(needle[0]), fold_first);
+	__m128i last = _mm_or_si128(_mm_set1_epi8(needle[nlen - 1]), fold_last);
+
+	size_t i = 0;
+	for (; i + nlen - 1 + 16 <= len; i += 16) {
+		__m128i block_first = _mm_or_si128(_mm_loadu_si128((const __m128i*) (s + i)), fold_first);
+		__m128i block_last = _mm_or_si128(_mm_loadu_si128((const __m128i*) (s + i + nlen - 1)), fold_last);
+		__m128i eq = _mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last));
+		unsigned mask = (unsigned) _mm_movemask_epi8(eq);
+		while (mask != 0) {
+			size_t candidate = i + __builtin_ctz(mask);
+			if (nocase ? equal_nocase_sse42(s + candidate, needle, nlen) : memcmp(s + candidate + 1, needle + 1, nlen - 2) == 0) {
+				return s + candidate;
+			}
+			mask &= mask - 1;
+		}
+	}
+
+	return find_substring_scalar(s + i, len - i, needle, nlen, nocase);
+}
+
+__attribute__((target("sse4.2")))
+bool equal_nocase_sse42(const char *a, const char *b, size_t len) {
+	__m128i before_a = _mm_set1_epi8('A' - 1);
+	__m128i after_z = _mm_set1_epi8('Z' + 1);
+	__m128i diff = _mm_set1_epi8('a' - 'A');
+
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i*) (a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i*) (b + i));
+		__m128i upper_a = _mm_and_si128(_mm_cmpgt_epi8(va, before_a), _mm_cmpgt_epi8(after_z, va));
+		__m128i upper_b = _mm_and_si128(_mm_cmpgt_epi8(vb, before_a), _mm_cmpgt_epi8(after_z, vb));
+		va = _mm_add_epi8(va, _mm_and_si128(upper_a, diff));
+		vb = _mm_add_epi8(vb, _mm_and_si128(upper_b, diff));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff) {
+			return false;
+		}
+	}
+
+	return equal_nocase_scalar(a + i, b + i, len - i);
+}
+#endif
+
+size_t find_any_resolve(const char *s, size_t len, const char *set, int nset);
+void lowercase_resolve(char *s, size_t len);
+const char *find_substring_resolve(const char *s, size_t len, const char *needle, size_t nlen, bool nocase);
+bool equal_nocase_resolve(const char *a, const char *b, size_t len);
+
+// Replaced by the best implementation on first call, can be set by hand (e.g. to the scalar ones)
+size_t (*simd_find_any)(const char *s, size_t len, const char *set, int nset) = find_any_resolve;
+void (*simd_lowercase)(char *s, size_t len) = lowercase_resolve;
+const char *(*simd_find_substring)(const char *s, size_t len, const char *needle, size_t nlen, bool nocase) = find_substring_resolve;
+bool (*simd_equal_nocase)(const char *a, const char *b, size_t len) = equal_nocase_resolve;
+
+#ifdef __GNUC__
+	#define simd_set(fn, impl) __atomic_store_n(&(fn), impl, __ATOMIC_RELAXED)
+#else
+	#define simd_set(fn, impl) ((fn) = (impl))
+#endif
+
+void simd_resolve(void) {
+	// every thread resolves to the same functions, the race is harmless as long as the stores are atomic
+#ifdef CER_DS_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		simd_set(simd_find_any, find_any_avx2);
+		simd_set(simd_lowercase, lowercase_avx2);
+		simd_set(simd_find_substring, find_substring_avx2);
+		simd_set(simd_equal_nocase, equal_nocase_avx2);
+		return;
+	}
+	if (__builtin_cpu_supports("sse4.2")) {
+		simd_set(simd_find_any, find_any_sse42);
+		simd_set(simd_lowercase, lowercase_sse42);
+		simd_set(simd_find_substring, find_substring_sse42);
+		simd_set(simd_equal_nocase, equal_nocase_sse42);
+		return;
+	}
+#endif
+	simd_set(simd_find_any, find_any_scalar);
+	simd_set(simd_lowercase, lowercase_scalar);
+	simd_set(simd_find_substring, find_substring_scalar);
+	simd_set(simd_equal_nocase, equal_nocase_scalar);
+}
+
+size_t find_any_resolve(const char *s, size_t len, const char *set, int nset) {
+	simd_resolve();
+	return simd_find_any(s, len, set, nset);
+}
+
+void lowercase_resolve(char *s, size_t len) {
+	simd_resolve();
+	simd_lowercase(s, len);
+}
+
+const char *find_substring_resolve(const char *s, size_t len, const char *needle, size_t nlen, bool nocase) {
+	simd_resolve();
+	return simd_find_substring(s, len, needle, nlen, nocase);
+}
+
+bool equal_nocase_resolve(const char *a, const char *b, size_t len) {
+	simd_resolve();
+	return simd_equal_nocase(a, b, len);
+}
+
+#endif // CER_DS_SIMD_H
@@ -3,6 +3,8 @@
 
 #include <ctype.h>
 #include <stdbool.h>
+#include <string.h>
+#include "simd.h"
 #ifdef _MSC_VER
 	#include <BaseTsd.h>
 	typedef SSIZE_T ssize_t;
@@ -24,20 +26,17 @@ bool slice_equal(Slice a, Slice b) {
 		return a.len == b.len;
 	}
 
-	return a.len == b.len && strncmp(a.ptr, b.ptr, a.len) == 0;
+	return a.len == b.len && memcmp(a.ptr, b.ptr, a.len) == 0;
 }
 
 bool slice_equal_cstr(Slice s, const char *cs) {
-	size_t si = 0;
-	while (si < s.len && *cs != '\0') {
-		if (s.ptr[si] != *cs) {
-			break;
-		}
-		si += 1;
-		cs += 1;
-	}
+	size_t len = strlen(cs);
+	return s.len == len && (len == 0 || memcmp(s.ptr, cs, len) == 0);
+}
 
-	return si == s.len && *cs == '\0';
+// ASCII case-insensitive slice_equal
+bool slice_equal_nocase(Slice a, Slice b) {
+	return a.len == b.len && (a.len == 0 || simd_equal_nocase(a.ptr, b.ptr, a.len));
 }
 
 Slice slice_cstr(const char *cstr) {
@@ -45,8 +44,26 @@ Slice slice_cstr(const char *cstr) {
 }
 
 size_t slice_cspn(Slice s, const char *reject) {
+	size_t nreject = strlen(reject);
+	if (s.len == 0 || nreject == 0) {
+		return s.len;
+	}
+	if (nreject == 1) {
+		const char *found = memchr(s.ptr, reject[0], s.len);
+		return found != NULL ? (size_t) (found - s.ptr) : s.len;
+	}
+	if (nreject <= 3) {
+		return simd_find_any(s.ptr, s.len, reject, (int) nreject);
+	}
+
+	unsigned char set[32] = {0};
+	for (size_t i = 0; i < nreject; i++) {
+		unsigned char c = reject[i];
+		set[c >> 3] |= 1 << (c & 7);
+	}
 	for (size_t i = 0; i < s.len; i++) {
-		if (strchr(reject, s.ptr[i]) != NULL) {
+		unsigned char c = s.ptr[i];
+		if (set[c >> 3] & (1 << (c & 7))) {
 			return i;
 		}
 	}
@@ -58,30 +75,14 @@ const char *slice_slice(Slice s, Slice needle) {
 	if (needle.len == 0) {
 		return s.ptr;
 	}
-
-	ssize_t bad_chars[256];
-	for (size_t i = 0; i < sizeof(bad_chars)/sizeof(bad_chars[0]); i++) {
-		bad_chars[i] = -1;
-	}
-	for (size_t i = 0; i < needle.len; i++) {
-		bad_chars[(unsigned char) needle.ptr[i]] = i;
+	if (s.len < needle.len) {
+		return NULL;
 	}
-
-	size_t i = 0;
-	while (i <= s.len - needle.len) {
-		ssize_t mismatch_idx = needle.len - 1;
-		while (mismatch_idx >= 0 && (s.ptr[i + mismatch_idx] == needle.ptr[mismatch_idx])) {
-			mismatch_idx -= 1;
-		}
-		if (mismatch_idx < 0) {
-			return s.ptr + i;
-		}
-
-		ssize_t bc = bad_chars[(unsigned char) s.ptr[i + mismatch_idx]];
-		i += (mismatch_idx > bc) ? mismatch_idx - bc : 1;
+	if (needle.len == 1) {
+		return memchr(s.ptr, needle.ptr[0], s.len);
 	}
 
-	return NULL;
+	return simd_find_substring(s.ptr, s.len, needle.ptr, needle.len, false);
 }
 
 size_t find_slice_in_slices(const Slice *s, size_t len, Slice key) {
@@ -99,27 +100,20 @@ const char *slice_strstr(Slice s, const char *needle) {
 }
 
 const char *slice_stristr(Slice s, const char *needle) {
-	if (*needle == '\0') {
+	size_t nlen = strlen(needle);
+	if (nlen == 0) {
 		return s.ptr;
 	}
-
-	size_t i = 0;
-	char needle0 = tolower((unsigned char) needle[0]);
-	while (i < s.len) {
-		if (tolower((unsigned char) s.ptr[i]) == needle0) {
-			size_t match_len = 0;
-			while (needle[match_len] != '\0' && i < s.len && tolower((unsigned char) s.ptr[i]) == tolower((unsigned char) needle[match_len])) {
-				i += 1;
-				match_len += 1;
-			}
-			if (needle[match_len] == '\0') {
-				return s.ptr + i - match_len;
-			}
-		}
-		i += 1;
+	if (s.len < nlen) {
+		return NULL;
+	}
+	if (nlen == 1) {
+		char cases[2] = { ascii_lower(needle[0]), toupper((unsigned char) needle[0]) };
+		size_t idx = simd_find_any(s.ptr, s.len, cases, cases[0] == cases[1] ? 1 : 2);
+		return idx < s.len ? s.ptr + idx : NULL;
 	}
 
-	return NULL;
+	return simd_find_substring(s.ptr, s.len, needle, nlen, true);
 }
 
 char *slice_strndup(Slice s, size_t len) {
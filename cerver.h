@@ -1,3 +1,7 @@
+#if defined(linux) && !defined(_GNU_SOURCE)
+	#define _GNU_SOURCE		// accept4, CPU affinity
+#endif
+
 #include <assert.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -5,11 +9,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #ifdef linux
 	#include <arpa/inet.h>
+	#include <errno.h>
+	#include <fcntl.h>
 	#include <netinet/in.h>
+	#include <poll.h>
+	#include <sys/random.h>
+	#include <sys/sendfile.h>
 	#include <sys/socket.h>
+	#include <sys/stat.h>
+	#include <sys/time.h>
+	#include <sys/uio.h>
 	#include <unistd.h>
 	#include <pthread.h>
 #elif defined(_WIN32)
@@ -21,75 +34,152 @@
 #endif
 
 #include "cer_ds.h"
-#include "response.h"
 #include "request.h"
+#include "response.h"
+#include "file_cache.h"
+
+#define REQUEST_READ_CHUNK 4096
+#define KEEP_ALIVE_TIMEOUT 5			// seconds
+#define KEEP_ALIVE_MAX_REQUESTS 100
+#define RESPONSE_COPY_LEN (16 * 1024)	// smaller bodies are copied behind their head, larger ones are sent from the response
+#define PIPELINE_FLUSH_LEN 65536		// flush coalesced responses once they grow past this
+#define LINGER_TIMEOUT 2				// seconds a connection closed with unread input is drained for
+#define MAX_REQUEST_BODY_LEN (64 << 20)	// buffered bodies over this are answered with 413
+#define REQUEST_PREALLOC_LEN (1 << 20)	// requests up to this are read into a buffer of their final size
+
+// Finds the handler of `path` among the routes of `method`, falling back to the route of the method alone
+const FlatRoute *match_route(Cerver *c, HttpMethod method, Slice path, Pairs *path_parameters) {
+	if (method >= METHOD_COUNT) {
+		return NULL;
+	}
 
-GString get_raw_request(int client, int *error) {
-	char buffer[4096];
-	GString plain_text = {0};
-	ssize_t bytes_read = recv(client, buffer, sizeof(buffer), 0);
-	if (bytes_read <= 0) {
-		*error = 400;
-		return plain_text;
-	}
-
-	char *crlf_crlf = strstr(buffer, "\r\n\r\n");
-	if (crlf_crlf == NULL) {
-		*error = 431;
-		return plain_text;
-	}
-	static const char content_length_header[] = "\r\ncontent-length: ";
-	const char *content_length_ptr = slice_stristr((Slice) { .ptr = buffer, .len = bytes_read }, content_length_header);
-	size_t content_length = 0;
-	if (content_length_ptr != NULL && content_length_ptr <= crlf_crlf) {
-		content_length_ptr += strlen(content_length_header);
-
-		while (*content_length_ptr != '\r') {
-			if (!isdigit(*content_length_ptr)) {
-				*error = 400;
-				return plain_text;
-			}
+	MethodRoutes *routes = &c->routes[method];
+	const FlatRoute *route = find_static_route(&c->static_routes, method, path);
+	if (route == NULL) {
+		route = find_table_route(&routes->table, path, path_parameters);
+	}
+	if (route == NULL && routes->fallback.callback != NULL) {
+		route = &routes->fallback;
+	}
+	return route;
+}
 
-			content_length = content_length * 10 + (*content_length_ptr - '0');
-			content_length_ptr += 1;
-		}
-		if (content_length_ptr[1] != '\n') {
-			return plain_text;
+// Streaming routes are matched as soon as the head is parsed, before the body is buffered
+bool is_stream_route(Cerver *c, Request *req) {
+	Slice path = req->path;
+	path.len = slice_cspn(path, "?#");
+
+	const FlatRoute *route = match_route(c, req->method_type, path, NULL);
+	return route != NULL && route->stream;
+}
+
+int keep_alive_timeout(Cerver *c) {
+	return c->keep_alive_timeout > 0 ? c->keep_alive_timeout : KEEP_ALIVE_TIMEOUT;
+}
+
+size_t max_body_size(Cerver *c) {
+	return c->max_body_size > 0 ? c->max_body_size : MAX_REQUEST_BODY_LEN;
+}
+
+/*
+ * Parses the bytes that arrived since the last call, returns the length of the first buffered request
+ * (headers + body, only headers for a streaming route) once its head is complete, 0 if more bytes are needed.
+ */
+size_t request_length(Cerver *c, Connection *conn, int *error) {
+	if (conn->request == NULL) {
+		conn->request = new_request();
+		if (conn->request == NULL) {
+			*error = 503;
+			return 0;
 		}
 	}
 
-	size_t bytes_left = 0;	// maximum size of the request
-	if (content_length > 0) {
-		bytes_left = (crlf_crlf - buffer) + strlen("\r\n\r\n") + content_length - bytes_read;
+	Request *req = conn->request;
+	bool head_parsed = req->parser.state == HTTP_BODY;
+	int status = parse_request_head(req, conn->input.ptr, conn->input.len);
+	if (status == REQUEST_INCOMPLETE) {
+		return 0;
+	}
+	if (status != 0) {
+		*error = status;
+		return 0;
 	}
-	gstr_append_cstr(&plain_text, buffer, bytes_read);
 
-	while (bytes_left > 0 || bytes_read == sizeof(buffer)) {
-		bytes_read = recv(client, buffer, sizeof(buffer), 0);
-		if (bytes_read == 0) {
-			break;
-		}
-		if (bytes_read == -1 || bytes_read > (ptrdiff_t) bytes_left) {
-			*error = 400;
-			return plain_text;
-		}
-		gstr_append_cstr(&plain_text, buffer, bytes_read);
-		bytes_left -= bytes_read;
+	if (!head_parsed && req->parser.content_length > 0) {
+		req->parser.stream = is_stream_route(c, req);
+	}
+	if (req->parser.stream) {
+		return req->parser.header_len;
+	}
+	if (req->parser.content_length > max_body_size(c) || req->parser.content_length > SIZE_MAX - req->parser.header_len) {
+		*error = 413;
+		return 0;
+	}
+	return req->parser.header_len + req->parser.content_length;
+}
+
+// Bytes still missing from the first buffered request, `chunk` while its head is incomplete, 0 once it was rejected
+size_t request_missing(Cerver *c, Connection *conn, size_t chunk) {
+	int error = 0;
+	size_t len = request_length(c, conn, &error);
+	if (error != 0) {
+		return 0;		// nothing more is read, the error is answered
 	}
-	if (plain_text.len == 0) {
-		*error = 400;
+	if (len == 0) {
+		return chunk;
+	}
+
+	return len > conn->input.len ? len - conn->input.len : 0;
+}
+
+/*
+ * Room to reserve for the next read: all that is `missing` for a request up to REQUEST_PREALLOC_LEN,
+ * a larger one grows with what arrives, doubling the buffer, so a Content-Length alone allocates nothing
+ */
+size_t request_read_len(const GString *in, size_t missing) {
+	if (in->len + missing <= REQUEST_PREALLOC_LEN) {
+		return missing;
 	}
-	return plain_text;
+
+	size_t grow = in->len > REQUEST_PREALLOC_LEN ? in->len : REQUEST_PREALLOC_LEN;
+	return grow < missing ? grow : missing;
 }
 
-Context *create_context(int client) {
-	// TODO: check calloc failed
-	Context *ctx = calloc(1, sizeof(Context));
-	ctx->request = calloc(1, sizeof(Request));
-	ctx->response = calloc(1, sizeof(Response));
+/*
+ * Hands the first `len` bytes of the connection input over to the request, the rest is kept for the next
+ * request in `spare` (an empty buffer left by a recycled request), which becomes the connection input.
+ */
+GString take_request(Connection *conn, size_t len, GString spare) {
+	GString raw = conn->input;
+	conn->input = spare;
+	gstr_clear(&conn->input);
+	if (raw.len > len) {
+		gstr_append_cstr(&conn->input, raw.ptr + len, raw.len - len);
+		raw.len = len;
+	}
 
+	return raw;
+}
+
+// True if another complete request is already buffered behind the current one
+bool has_pipelined_request(Cerver *c, Connection *conn) {
 	int error = 0;
-	ctx->request->arena = get_raw_request(client, &error);
+	size_t len = request_length(c, conn, &error);
+	return error == 0 && len > 0 && len <= conn->input.len;
+}
+
+// The context and its response come with the request, NULL if out of memory
+Context *create_context(int client, Request *req, int error) {
+	if (req == NULL) {
+		req = new_request();
+		if (req == NULL) {
+			return NULL;
+		}
+	}
+
+	Context *ctx = request_context(req);
+	ctx->client = client;
+
 	if (error != 0) {
 		ctx->status_code = error;
 		return ctx;
@@ -97,47 +187,438 @@ Context *create_context(int client) {
 	// debug("%.*s", (int) ctx->request->arena.len, ctx->request->arena.ptr);
 
 	ctx->status_code = parse_request(ctx->request);
-	ctx->client = client;
 	return ctx;
 }
 
-void *handle(void *arg) {
-	ThreadInfo *tinfo = (ThreadInfo*) arg;
-	int client = tinfo->client;
-	Cerver *c = tinfo->c;
+// Hands the request being parsed and its `len` bytes over to a new context
+Context *take_context(Connection *conn, size_t len, int error) {
+	Request *req = conn->request;
+	conn->request = NULL;
+	if (error != 0) {
+		if (req != NULL) {
+			free_request(req);
+		}
+		return create_context(conn->client, NULL, error);
+	}
+
+	req->arena = take_request(conn, len, req->arena);
+	Context *ctx = create_context(conn->client, req, 0);
+	if (req->parser.stream && ctx->status_code == 0) {
+		ctx->conn = conn;
+		ctx->body_left = req->parser.content_length;
+	}
+	return ctx;
+}
+
+/*
+ * Streaming routes: copies up to `len` bytes of the request body into `buf`, the bytes that arrived with the
+ * head first, then straight from the socket. Returns 0 once the whole body was read, -1 on error or timeout.
+ */
+ssize_t read_body(Context *ctx, char *buf, size_t len) {
+	Connection *conn = ctx->conn;
+	if (ctx->body_error != 0) {
+		return -1;
+	}
+	if (conn == NULL || ctx->body_left == 0) {
+		return 0;
+	}
+	if (len > ctx->body_left) {
+		len = ctx->body_left;
+	}
+
+	GString *in = &conn->input;
+	if (in->len > 0) {
+		size_t n = len < in->len ? len : in->len;
+		memcpy(buf, in->ptr, n);
+		memmove(in->ptr, in->ptr + n, in->len - n);
+		in->len -= n;
+		ctx->body_left -= n;
+		return n;
+	}
+
+	while (1) {
+#ifdef linux
+		ssize_t bytes_read = recv(conn->client, buf, len, MSG_DONTWAIT);
+#else
+		ssize_t bytes_read = recv(conn->client, buf, len, 0);
+#endif
+		if (bytes_read > 0) {
+			ctx->body_left -= bytes_read;
+			return bytes_read;
+		}
+#ifdef linux
+		if (bytes_read == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			struct pollfd pfd = { .fd = conn->client, .events = POLLIN };
+			int nready = poll(&pfd, 1, ctx->body_timeout * 1000);
+			if (nready > 0 || (nready == -1 && errno == EINTR)) {
+				continue;
+			}
+			ctx->body_error = nready == 0 ? 408 : 400;
+			return -1;
+		}
+#endif
+		ctx->body_error = 400;	// closed or failed before the end of the body
+		return -1;
+	}
+}
 
-	Context *ctx = create_context(client);
-	Slice method = ctx->request->method;
-	Slice path = ctx->request->path;
+// Skips the part of a streamed body the handler did not read, false if the connection can't be reused
+bool discard_body(Context *ctx) {
+	char buf[REQUEST_READ_CHUNK];
+	ssize_t bytes_read = 0;
+	while ((bytes_read = read_body(ctx, buf, sizeof(buf))) > 0) {
+	}
 
-	GString arena = {0};
-	gstr_append_fmt_null(&arena, "%Sl:%Sl", method, path);
+	return bytes_read == 0;
+}
 
-	RouteNode *route = find_dynamic_route(c->route, arena.ptr, &ctx->request->path_parameters);
-	if (route != NULL && route->callback != NULL) {
+// Blocks until a full request is buffered, returns NULL if the peer closed or went idle
+Context *get_request(Cerver *c, Connection *conn) {
+	while (1) {
+		int error = 0;
+		size_t len = request_length(c, conn, &error);
+		if (error != 0 || (len > 0 && len <= conn->input.len)) {
+			return take_context(conn, len, error);
+		}
+
+		// once Content-Length is known the buffer grows towards the size of the request and the body is read in place
+		size_t missing = len > 0 ? len - conn->input.len : REQUEST_READ_CHUNK;
+		if (!gstr_reserve_exact(&conn->input, request_read_len(&conn->input, missing))) {
+			return take_context(conn, 0, 503);
+		}
+		GString *in = &conn->input;
+		ssize_t bytes_read = recv(conn->client, in->ptr + in->len, in->capacity - in->len, 0);
+		if (bytes_read == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytes_read <= 0) {
+			if (in->len > 0) {
+				return take_context(conn, 0, 400);
+			}
+			return NULL;
+		}
+		in->len += bytes_read;
+	}
+}
+
+void dispatch(Cerver *c, Context *ctx) {
+	if (ctx->status_code != 0) {
+		return;
+	}
+
+	const FlatRoute *route = match_route(c, ctx->request->method_type, ctx->request->path, &ctx->request->path_parameters);
+	if (route != NULL) {
 		(void) ((Callback) route->callback)(ctx);
 	}
 	else {
-		arena.ptr[method.len] = '\0';
-		route = find_route(c->route, arena.ptr);
-		if (route != NULL && route->callback != NULL) {
-			(void) ((Callback) route->callback)(ctx);
+		ctx->status_code = 404;
+	}
+}
+
+bool request_keep_alive(Request *req) {
+	Slice connection = request_known_header(req, HEADER_CONNECTION);
+	if (slice_stristr(connection, "close") != NULL) {
+		return false;
+	}
+	if (slice_stristr(connection, "keep-alive") != NULL) {
+		return true;
+	}
+
+	return slice_equal_cstr(req->http_version, "HTTP/1.1");
+}
+
+// Runs the request, returns true if the connection stays open for the next one
+bool process_request(Cerver *c, Context *ctx, size_t nrequests) {
+	size_t max_requests = c->max_requests > 0 ? c->max_requests : KEEP_ALIVE_MAX_REQUESTS;
+	bool keep_alive = ctx->status_code == 0 && nrequests < max_requests && request_keep_alive(ctx->request);
+
+	ctx->body_timeout = keep_alive_timeout(c);
+	dispatch(c, ctx);
+	if (!discard_body(ctx)) {
+		keep_alive = false;
+		if (ctx->status_code == 0) {
+			ctx->status_code = ctx->body_error;	// the handler gave up on the body without answering
 		}
 	}
-	gstr_free(&arena);
 
-	if (!send_response(ctx)) {
-		debug("%s", "Failed to response: Broken pipe");
+	if (!keep_alive) {
+		set_response_header(ctx, "Connection", "close");
+	}
+	else if (!slice_equal_cstr(ctx->request->http_version, "HTTP/1.1")) {
+		set_response_header(ctx, "Connection", "keep-alive");
+	}
+
+	return keep_alive;
+}
+
+/*
+ * Serializes the response behind the pending output. A large body is not copied: its buffer is swapped
+ * into conn->body and sent right after output, so nothing can be queued behind it until it is flushed.
+ */
+void queue_response(Connection *conn, Context *ctx) {
+	strput_response_head(&conn->output, ctx);
+
+	Response *resp = ctx->response;
+	GString *body = &resp->body;
+	if (body->len >= RESPONSE_COPY_LEN) {
+		GString spare = conn->body;
+		conn->body = *body;
+		*body = spare;
+		gstr_clear(body);
+	}
+	else if (body->len > 0) {
+		gstr_append_cstr(&conn->output, body->ptr, body->len);
 	}
 
-	free_context(ctx);
+	// a shared body is sent from where it is kept, unless it is small enough to copy behind the rest
+	SharedBody *shared = &resp->shared;
+	if (shared->data.len >= RESPONSE_COPY_LEN || (shared->data.len > 0 && conn->body.len > 0)) {
+		conn->shared = *shared;
+		*shared = (SharedBody) {0};
+	}
+	else if (shared->data.len > 0) {
+		gstr_append_cstr(&conn->output, shared->data.ptr, shared->data.len);
+		release_shared_body(shared);
+	}
+
+	// a file follows the body, the connection takes over its descriptor
+	if (resp->file_len > 0) {
+		conn->file = resp->file;
+		conn->file_offset = resp->file_offset;
+		conn->file_len = resp->file_len;
+		resp->file_len = 0;
+	}
+}
+
+// True once nothing can be queued behind the pending output until it is flushed
+bool connection_blocked(const Connection *conn) {
+	return conn->output.len >= PIPELINE_FLUSH_LEN || conn->body.len > 0 || conn->shared.data.len > 0 || conn->file_len > 0;
+}
+
+size_t connection_pending(const Connection *conn) {
+	return conn->output.len + conn->body.len + conn->shared.data.len - conn->output_sent + conn->file_len;
+}
+
+// Accounts for `n` bytes sent, the buffers are emptied once everything went out
+void connection_sent(Connection *conn, size_t n) {
+	conn->output_sent += n;
+	if (conn->output_sent >= conn->output.len + conn->body.len + conn->shared.data.len) {
+		gstr_clear(&conn->output);
+		trim_gstr(&conn->body);
+		release_shared_body(&conn->shared);
+		conn->output_sent = 0;
+	}
+}
+
+#ifdef linux
+// Accounts for `n` bytes of the file sent, it is closed after the last one
+void connection_file_sent(Connection *conn, size_t n) {
+	conn->file_offset += n;
+	conn->file_len -= n;
+	if (conn->file_len == 0) {
+		close(conn->file);
+	}
+}
+
+// The unsent part of output, body and shared, returns the number of iovecs used
+int connection_iov(const Connection *conn, struct iovec iov[3]) {
+	const char *parts[3] = { conn->output.ptr, conn->body.ptr, conn->shared.data.ptr };
+	size_t lens[3] = { conn->output.len, conn->body.len, conn->shared.data.len };
+	size_t sent = conn->output_sent;
+	int n = 0;
+	for (int i = 0; i < 3; i++) {
+		if (sent < lens[i]) {
+			iov[n++] = (struct iovec) { .iov_base = (char*) parts[i] + sent, .iov_len = lens[i] - sent };
+		}
+		sent = sent > lens[i] ? sent - lens[i] : 0;
+	}
+
+	return n;
+}
+#endif
+
+// Blocking send of everything queued on the connection, false on error
+bool connection_flush(Connection *conn) {
+#ifdef linux
+	bool success = true;
+	struct iovec iov[3];
+	struct msghdr msg = { .msg_iov = iov };
+	while (success && (msg.msg_iovlen = connection_iov(conn, iov)) > 0) {
+		ssize_t sent = sendmsg(conn->client, &msg, MSG_NOSIGNAL);
+		if (sent == -1 && errno == EINTR) {
+			continue;
+		}
+		success = sent > 0;
+		if (success) {
+			connection_sent(conn, sent);
+		}
+	}
+	if (success && conn->file_len > 0) {
+		success = send_file(conn->client, conn->file, conn->file_offset, conn->file_len);
+	}
+#else
+	bool success = send_parts(conn->client, conn->output.ptr + conn->output_sent, conn->output.len - conn->output_sent,
+		conn->body.ptr, conn->body.len);
+#endif
+	connection_sent(conn, connection_pending(conn) - conn->file_len);
+	close_file(&conn->file, &conn->file_len);
+	return success;
+}
+
+// Answers the complete requests buffered in conn->input into conn->output, returns false if there was none
+bool answer_buffered_requests(Cerver *c, Connection *conn) {
+	bool answered = false;
+	while ((conn->nrequests == 0 || conn->keep_alive) && !connection_blocked(conn)) {
+		int error = 0;
+		size_t len = request_length(c, conn, &error);
+		if (error == 0 && (len == 0 || len > conn->input.len)) {
+			break;
+		}
+		// a streaming handler reads its body with blocking calls, the loop hands the connection to a thread instead
+		if (error == 0 && conn->request->parser.stream) {
+			conn->detach = true;
+			break;
+		}
+
+		Context *ctx = take_context(conn, len, error);
+		if (ctx == NULL) {
+			conn->keep_alive = false;
+			conn->eof = true;
+			break;
+		}
+		conn->nrequests += 1;
+		conn->keep_alive = process_request(c, ctx, conn->nrequests);
+		queue_response(conn, ctx);
+		free_context(ctx);
+		answered = true;
+	}
+
+	return answered;
+}
+
+#ifdef linux
+bool worker_pool_busy(WorkerPool *pool);
+
+// Waits for the next request on an idle connection, gives up early if the pool has queued connections
+bool wait_next_request(Cerver *c, int client) {
+	int timeout_ms = keep_alive_timeout(c) * 1000;
+	while (timeout_ms > 0) {
+		int wait_ms = c->pool != NULL && timeout_ms > 100 ? 100 : timeout_ms;
+		struct pollfd pfd = { .fd = client, .events = POLLIN };
+		int nready = poll(&pfd, 1, wait_ms);
+		if (nready > 0) {
+			return true;
+		}
+		if (nready == -1 && errno != EINTR) {
+			return false;
+		}
+
+		timeout_ms -= wait_ms;
+		if (c->pool != NULL && worker_pool_busy(c->pool)) {
+			return false;
+		}
+	}
+
+	return false;
+}
+#endif
+
+#ifdef linux
+/*
+ * Closing a socket with unread input resets the connection and the client can lose the last response
+ * before reading it. Half-closes instead and drops what still arrives until the client closes, for at
+ * most LINGER_TIMEOUT.
+ */
+void drain_socket(int client) {
+	shutdown(client, SHUT_WR);
+
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	char buf[REQUEST_READ_CHUNK];
+	while (1) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long long left_ms = LINGER_TIMEOUT * 1000LL - (now.tv_sec - start.tv_sec) * 1000LL - (now.tv_nsec - start.tv_nsec) / 1000000;
+		struct pollfd pfd = { .fd = client, .events = POLLIN };
+		if (left_ms <= 0 || poll(&pfd, 1, left_ms) <= 0) {
+			break;
+		}
+		ssize_t n = recv(client, buf, sizeof(buf), MSG_DONTWAIT);
+		if (n == 0 || (n == -1 && errno != EINTR && errno != EAGAIN)) {
+			break;
+		}
+	}
+}
+#endif
+
+// Answers the requests of `conn` with blocking reads and writes until it closes, then closes the socket
+void serve_requests(Cerver *c, Connection *conn) {
+	int client = conn->client;
+
+	// bounds how long a client may stall in the middle of a request
+#ifdef linux
+	struct timeval timeout = { .tv_sec = keep_alive_timeout(c) };
+#else
+	DWORD timeout = keep_alive_timeout(c) * 1000;
+#endif
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (const char*) &timeout, sizeof(timeout));
+
+	bool keep_alive = true, broken = false;
+	while (keep_alive) {
+#ifdef linux
+		if (conn->nrequests > 0 && conn->input.len == 0 && !wait_next_request(c, client)) {
+			break;
+		}
+#endif
+
+		Context *ctx = get_request(c, conn);
+		if (ctx == NULL) {
+			break;
+		}
+
+		conn->nrequests += 1;
+		keep_alive = process_request(c, ctx, conn->nrequests);
+		queue_response(conn, ctx);
+		free_context(ctx);
+
+		// responses to pipelined requests are coalesced into a single write
+		if (keep_alive && !connection_blocked(conn) && has_pipelined_request(c, conn)) {
+			continue;
+		}
+
+		if (!connection_flush(conn)) {
+			debug("%s", "Failed to response: Broken pipe");
+			keep_alive = false;
+			broken = true;
+		}
+	}
+
+#ifdef linux
+	// the input the last response left unread, e.g. a rejected head
+	if (!broken && conn->input.len > 0) {
+		drain_socket(client);
+	}
+#endif
+	free_connection(conn);
 
 #ifdef linux
 	close(client);
 #else
 	closesocket(client);
 #endif
+}
+
+void serve_connection(Cerver *c, int client) {
+	Connection conn = { .client = client };
+	serve_requests(c, &conn);
+}
 
+void *handle(void *arg) {
+	ThreadInfo *tinfo = (ThreadInfo*) arg;
+	serve_connection(tinfo->c, tinfo->client);
+	free_request_cache();
 	free(arg);
 
 	return 0;
@@ -145,59 +626,157 @@ void *handle(void *arg) {
 
 #define get(c, route, callback) register_route(&(c), "GET:"route, callback)
 #define post(c, route, callback) register_route(&(c), "POST:"route, callback)
+#define post_stream(c, route, callback) register_stream_route(&(c), "POST:"route, callback)
+#define put_stream(c, route, callback) register_stream_route(&(c), "PUT:"route, callback)
+/*
+ * Finds the routes of the method `key` starts with, "METHOD:path", and its path. A key without a path
+ * registers the fallback of the method
+ */
+MethodRoutes *route_key(Cerver *c, const char *key, const char **path) {
+	size_t method_len = strcspn(key, ":");
+	HttpMethod method = parse_method((Slice) { .ptr = key, .len = method_len });
+	if (method == METHOD_UNKNOWN) {
+		return NULL;
+	}
+
+	*path = key[method_len] == ':' ? key + method_len + 1 : NULL;
+	return &c->routes[method];
+}
+
 bool register_route(Cerver *c, const char *key, Callback callback) {
-	if (callback == NULL) {
+	const char *path = NULL;
+	MethodRoutes *routes = route_key(c, key, &path);
+	if (callback == NULL || routes == NULL) {
 		return false;
 	}
+	if (path == NULL) {
+		routes->fallback = (FlatRoute) { .callback = callback };
+		return true;
+	}
 
-	RouteNode *route = add_route(c->route, key, callback);
+	RouteNode *route = add_route(routes->root, path + strspn(path, "/"), callback);
 	if (route == NULL) {
 		return false;
 	}
-	if (c->route == NULL) {
-		c->route = route;
+	if (routes->root == NULL) {
+		routes->root = route;
 	}
 	return true;
 }
 
-bool run(Cerver *c, int port) {
-#ifdef _WIN32
-    WSADATA d;
-    if (WSAStartup(MAKEWORD(2, 2), &d)) {
-		trace_log;
+// The callback is run as soon as the head arrives and reads the body itself with read_body()
+bool register_stream_route(Cerver *c, const char *key, Callback callback) {
+	if (!register_route(c, key, callback)) {
 		return false;
-    }
-#endif
+	}
+
+	const char *path = NULL;
+	MethodRoutes *routes = route_key(c, key, &path);
+	if (path == NULL) {
+		routes->fallback.stream = true;
+		return true;
+	}
 
+	RouteNode *route = find_exact_route(routes->root, path);
+	if (route == NULL) {
+		return false;
+	}
+
+	route->stream = true;
+	return true;
+}
+
+// Builds the lookup tables of the registered routes, see freeze_routes() and freeze_static_routes()
+bool freeze_all_routes(Cerver *c) {
+	free_static_routes(&c->static_routes);
+	for (size_t i = 0; i < METHOD_COUNT; i++) {
+		if (!freeze_routes(&c->routes[i].table, c->routes[i].root) ||
+			!freeze_static_routes(&c->static_routes, i, c->routes[i].root)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int open_listener(int port) {
 	struct sockaddr_in ser_addr = {
 		.sin_family = AF_INET,
 		.sin_addr = { htonl(INADDR_ANY) },
 		.sin_port = htons(port)
 	};
 
-	c->server = socket(AF_INET, SOCK_STREAM, 0);
-	if (c->server == -1) {
-		return false;
+	int server = socket(AF_INET, SOCK_STREAM, 0);
+	if (server == -1) {
+		return -1;
 	}
 
 #ifndef _WIN32
 	int reuse = 1;
-	if (setsockopt(c->server, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
-		return false;
+	if (setsockopt(server, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+		return -1;
 	}
 #endif
 
-	if (bind(c->server, (struct sockaddr*) &ser_addr, sizeof(ser_addr)) == -1) {
-		return false;
+	if (bind(server, (struct sockaddr*) &ser_addr, sizeof(ser_addr)) == -1) {
+		return -1;
 	}
 
-	int connection_backlog = 10;
-	if (listen(c->server, connection_backlog) == -1) {
-		return false;
+	int connection_backlog = SOMAXCONN;
+	if (listen(server, connection_backlog) == -1) {
+		return -1;
 	}
 
 	unsigned char *saddr = (unsigned char*) &ser_addr.sin_addr.s_addr;
 	debug("Server run at %d.%d.%d.%d:%d", saddr[0], saddr[1], saddr[2], saddr[3], ser_addr.sin_port);
+	return server;
+}
+
+#ifdef linux
+	#include "event_loop.h"
+	#include "worker_pool.h"
+	#include "uring.h"
+#endif
+
+bool run(Cerver *c, int port) {
+#ifdef _WIN32
+    WSADATA d;
+    if (WSAStartup(MAKEWORD(2, 2), &d)) {
+		trace_log;
+		return false;
+    }
+#endif
+
+	if (!freeze_all_routes(c)) {
+		return false;
+	}
+
+	c->server = open_listener(port);
+	if (c->server == -1) {
+		return false;
+	}
+
+#ifdef linux
+	if (c->mode == CERVER_EVENT_LOOP) {
+		if (c->nlisteners > 1) {
+			return run_sharded_event_loops(c, port);
+		}
+		return run_event_loop(c, c->server);
+	}
+	else if (c->mode == CERVER_WORKER_POOL) {
+		c->pool = create_worker_pool(c, c->nworkers);
+		if (c->pool == NULL) {
+			return false;
+		}
+	}
+	else if (c->mode == CERVER_IO_URING) {
+		Uring ring = {0};
+		if (uring_init(&ring)) {
+			return run_uring(c, &ring, c->server);
+		}
+		debug("%s", "io_uring is not available, falling back to a thread per connection");
+	}
+#endif
 	while (1) {
 		struct sockaddr_in cli_addr;
 		unsigned int cli_addr_size = sizeof(cli_addr);
@@ -207,9 +786,16 @@ bool run(Cerver *c, int port) {
 			break;
 		}
 
-		saddr = (unsigned char*) &cli_addr.sin_addr.s_addr;
+		unsigned char *saddr = (unsigned char*) &cli_addr.sin_addr.s_addr;
 		debug("Connection: %d.%d.%d.%d:%d", saddr[0], saddr[1], saddr[2], saddr[3], cli_addr.sin_port);
 
+#ifdef linux
+		if (c->pool != NULL) {
+			worker_pool_submit(c->pool, client);
+			continue;
+		}
+#endif
+
 		ThreadInfo *tinfo = malloc(sizeof(ThreadInfo));
 		tinfo->c = c;
 		tinfo->client = client;
@@ -224,10 +810,11 @@ bool run(Cerver *c, int port) {
 #endif
 	}
 
-#ifdef _WIN32
+#ifdef linux
+	free_worker_pool(c->pool);
+	c->pool = NULL;
+#elif defined(_WIN32)
 		WSACleanup();
 #endif
 	return true;
 }
-
-
@@ -0,0 +1,522 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <linux/filter.h>
+#include <sys/epoll.h>
+
+#define EVENT_LOOP_MAX_EVENTS 256
+#define CONNECTION_READ_CHUNK 4096
+
+bool set_nonblocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1) {
+		return false;
+	}
+
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+typedef struct {
+	Connection *head;			// least recently active
+	Connection *tail;
+} ConnectionList;
+
+long long monotonic_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void connection_list_remove(ConnectionList *list, Connection *conn) {
+	if (conn->prev != NULL) {
+		conn->prev->next = conn->next;
+	}
+	else {
+		list->head = conn->next;
+	}
+	if (conn->next != NULL) {
+		conn->next->prev = conn->prev;
+	}
+	else {
+		list->tail = conn->prev;
+	}
+	conn->prev = conn->next = NULL;
+}
+
+void connection_list_push(ConnectionList *list, Connection *conn) {
+	conn->prev = list->tail;
+	conn->next = NULL;
+	if (list->tail != NULL) {
+		list->tail->next = conn;
+	}
+	else {
+		list->head = conn;
+	}
+	list->tail = conn;
+}
+
+void close_connection(int epfd, ConnectionList *list, Connection *conn) {
+	connection_list_remove(list, conn);
+	epoll_ctl(epfd, EPOLL_CTL_DEL, conn->client, NULL);
+	close(conn->client);
+	free_connection(conn);
+	free(conn);
+}
+
+// Reads until the socket is drained or a full request is buffered, returns the number of bytes read or -1 on error
+ssize_t connection_recv(Cerver *c, Connection *conn) {
+	ssize_t total = 0;
+	while (!conn->eof) {
+		size_t missing = request_missing(c, conn, CONNECTION_READ_CHUNK);
+		if (missing == 0) {
+			break;
+		}
+		if (!gstr_reserve_exact(&conn->input, request_read_len(&conn->input, missing))) {
+			return -1;
+		}
+
+		GString *in = &conn->input;
+		ssize_t bytes_read = recv(conn->client, in->ptr + in->len, in->capacity - in->len, 0);
+		if (bytes_read > 0) {
+			in->len += bytes_read;
+			total += bytes_read;
+		}
+		else if (bytes_read == 0) {
+			conn->eof = true;
+		}
+		else if (errno == EINTR) {
+			continue;
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			break;
+		}
+		else {
+			return -1;
+		}
+	}
+
+	return total;
+}
+
+/*
+ * Sends as much of the pending output, body and file as the socket takes: output and body with one
+ * sendmsg per try, then the file with sendfile in chunks of at most SENDFILE_CHUNK. False on error.
+ */
+bool connection_send(Connection *conn) {
+	while (connection_pending(conn) > 0) {
+		struct iovec iov[3];
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = connection_iov(conn, iov) };
+		ssize_t sent = 0;
+		if (msg.msg_iovlen > 0) {
+			sent = sendmsg(conn->client, &msg, MSG_NOSIGNAL);
+		}
+		else {
+			off_t offset = conn->file_offset;
+			sent = sendfile(conn->client, conn->file, &offset, conn->file_len < SENDFILE_CHUNK ? conn->file_len : SENDFILE_CHUNK);
+			if (sent == 0) {
+				return false;	// the file was truncated
+			}
+		}
+
+		if (sent > 0) {
+			if (msg.msg_iovlen > 0) {
+				connection_sent(conn, sent);
+			}
+			else {
+				connection_file_sent(conn, sent);
+			}
+		}
+		else if (sent == -1 && errno == EINTR) {
+			continue;
+		}
+		else if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return true;	// wait for EPOLLOUT
+		}
+		else {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+typedef struct {
+	Cerver *c;
+	Connection *conn;
+} DetachedInfo;
+
+// Sends what the loop left pending, then serves the connection with blocking calls like a thread per connection
+void *detached_main(void *arg) {
+	DetachedInfo *dinfo = (DetachedInfo*) arg;
+	Connection *conn = dinfo->conn;
+	conn->detach = false;
+
+	int flags = fcntl(conn->client, F_GETFL);
+	if (flags != -1 && fcntl(conn->client, F_SETFL, flags & ~O_NONBLOCK) != -1 && connection_send(conn)) {
+		serve_requests(dinfo->c, conn);
+	}
+	else {
+		close(conn->client);
+		free_connection(conn);
+	}
+	free(conn);
+	free(dinfo);
+	free_request_cache();
+	return NULL;
+}
+
+/*
+ * Moves a connection whose next request goes to a streaming route to a thread of its own, so the handler
+ * waiting for its body doesn't stall the loop. The caller already let go of it, it is closed if no thread starts.
+ */
+void detach_connection(Cerver *c, Connection *conn) {
+	DetachedInfo *dinfo = malloc(sizeof(DetachedInfo));
+	if (dinfo != NULL) {
+		*dinfo = (DetachedInfo) { .c = c, .conn = conn };
+		pthread_t t;
+		if (pthread_create(&t, NULL, detached_main, dinfo) == 0) {
+			pthread_detach(t);
+			return;
+		}
+		free(dinfo);
+	}
+
+	close(conn->client);
+	free_connection(conn);
+	free(conn);
+}
+
+/*
+ * drain_socket() for the loop: a connection closed with unread input is half-closed and kept until the
+ * client closes or the idle timeout, dropping what arrives. Returns false once it can be closed.
+ */
+bool connection_drain(Connection *conn) {
+	if (!conn->draining) {
+		if (conn->input.len == 0) {
+			return false;
+		}
+		conn->draining = true;
+		gstr_clear(&conn->input);
+		shutdown(conn->client, SHUT_WR);
+	}
+
+	char buf[CONNECTION_READ_CHUNK];
+	while (1) {
+		ssize_t n = recv(conn->client, buf, sizeof(buf), 0);
+		if (n > 0 || (n == -1 && errno == EINTR)) {
+			continue;
+		}
+		return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+	}
+}
+
+/*
+ * Drives the connection state machine as far as the socket allows:
+ * READING (until a full request is buffered) -> WRITING (until the response is flushed) -> READING ...
+ * Pipelined requests that are already buffered are answered before writing, with a single send.
+ * Returns false if the connection should be closed.
+ */
+bool connection_resume(Cerver *c, Connection *conn) {
+	while (1) {
+		if (conn->state == CONNECTION_WRITING) {
+			if (!connection_send(conn)) {
+				return false;
+			}
+			if (connection_pending(conn) > 0) {
+				return true;
+			}
+			if (!conn->keep_alive) {
+				return connection_drain(conn);
+			}
+
+			conn->state = CONNECTION_READING;
+		}
+
+		// responses to pipelined requests are coalesced into a single write
+		if (answer_buffered_requests(c, conn)) {
+			conn->state = CONNECTION_WRITING;
+			continue;
+		}
+		if (conn->detach) {
+			return true;	// the caller moves it to a thread
+		}
+
+		ssize_t bytes_read = connection_recv(c, conn);
+		if (bytes_read < 0) {
+			return false;
+		}
+		if (bytes_read == 0) {
+			return !conn->eof;	// wait for the rest of the request
+		}
+	}
+}
+
+/*
+ * Accepts until the queue is empty, the listener is edge-triggered. Out of descriptors, `spare` (held for
+ * this) is given up to accept and close the pending connections, so they aren't left waiting for the next edge.
+ */
+void accept_connections(int epfd, ConnectionList *list, int server, int *spare) {
+	while (1) {
+		struct sockaddr_in cli_addr;
+		socklen_t cli_addr_size = sizeof(cli_addr);
+		int client = accept4(server, (struct sockaddr*) &cli_addr, &cli_addr_size, SOCK_NONBLOCK);
+		if (client == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno == EMFILE || errno == ENFILE) && *spare != -1) {
+				close(*spare);
+				client = accept(server, NULL, NULL);
+				if (client != -1) {
+					close(client);
+				}
+				*spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+				if (client != -1) {
+					continue;
+				}
+			}
+			return;		// EAGAIN, the next connection raises a new event
+		}
+
+		unsigned char *saddr = (unsigned char*) &cli_addr.sin_addr.s_addr;
+		debug("Connection: %d.%d.%d.%d:%d", saddr[0], saddr[1], saddr[2], saddr[3], cli_addr.sin_port);
+
+		Connection *conn = calloc(1, sizeof(Connection));
+		if (conn == NULL) {
+			close(client);
+			continue;
+		}
+		conn->client = client;
+		conn->state = CONNECTION_READING;
+		conn->last_active = monotonic_ms();
+
+		struct epoll_event ev = {
+			.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+			.data.ptr = conn,
+		};
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, client, &ev) == -1) {
+			close(client);
+			free(conn);
+			continue;
+		}
+		connection_list_push(list, conn);
+	}
+}
+
+/*
+ * Single threaded, edge-triggered event loop, every connection is driven by connection_resume().
+ * Handlers run on the loop thread, a handler that blocks stalls every connection. Streaming routes are
+ * the exception, their connections are moved to a thread of their own.
+ */
+bool run_event_loop(Cerver *c, int server) {
+	if (!set_nonblocking(server)) {
+		return false;
+	}
+
+	int epfd = epoll_create1(0);
+	if (epfd == -1) {
+		return false;
+	}
+
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLET,
+		.data.ptr = NULL,
+	};
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, server, &ev) == -1) {
+		close(epfd);
+		return false;
+	}
+
+	struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+	ConnectionList list = {0};
+	long long idle_timeout = keep_alive_timeout(c) * 1000LL;
+	int spare = open("/dev/null", O_RDONLY | O_CLOEXEC);	// given up to drain the listener when out of descriptors
+	bool stop = false;
+	while (!stop && c->server != -1) {
+		int nevents = epoll_wait(epfd, events, EVENT_LOOP_MAX_EVENTS, 1000);
+		if (nevents == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		long long now = monotonic_ms();
+		for (int i = 0; i < nevents; i++) {
+			Connection *conn = events[i].data.ptr;
+			if (conn == NULL) {
+				if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+					stop = true;	// the listener was shut down
+				}
+				else {
+					accept_connections(epfd, &list, server, &spare);
+				}
+				continue;
+			}
+
+			if ((events[i].events & EPOLLERR) || !connection_resume(c, conn)) {
+				close_connection(epfd, &list, conn);
+				continue;
+			}
+			if (conn->detach) {
+				connection_list_remove(&list, conn);
+				epoll_ctl(epfd, EPOLL_CTL_DEL, conn->client, NULL);
+				detach_connection(c, conn);
+				continue;
+			}
+			if (conn->draining) {
+				continue;	// what a draining client sends doesn't keep it alive
+			}
+
+			conn->last_active = now;
+			connection_list_remove(&list, conn);
+			connection_list_push(&list, conn);
+		}
+
+		while (list.head != NULL && now - list.head->last_active >= idle_timeout) {
+			close_connection(epfd, &list, list.head);
+		}
+	}
+
+	while (list.head != NULL) {
+		close_connection(epfd, &list, list.head);
+	}
+	close(epfd);
+	if (spare != -1) {
+		close(spare);
+	}
+	free_request_cache();
+	return true;
+}
+
+typedef struct {
+	Cerver *c;
+	int server;
+} ListenerInfo;
+
+void *listener_main(void *arg) {
+	ListenerInfo *linfo = (ListenerInfo*) arg;
+	if (!run_event_loop(linfo->c, linfo->server)) {
+		debug("%s", "Failed to start an event loop");
+	}
+
+	return NULL;
+}
+
+bool pin_thread(pthread_t t, size_t cpu) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(t, sizeof(set), &set) == 0;
+}
+
+/*
+ * Let the kernel pick the listener of a new connection by the CPU that received it: socket i of the
+ * reuseport group is served by the loop pinned to CPU i, so the connection stays on that CPU.
+ */
+bool attach_reuseport_cbpf(int server, size_t nlisteners) {
+	struct sock_filter code[] = {
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, (unsigned int) nlisteners },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(code)/sizeof(code[0]),
+		.filter = code,
+	};
+
+	return setsockopt(server, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+}
+
+/*
+ * Open `nlisteners` sockets on the same port (SO_REUSEPORT) and serve each one by its own event loop
+ * pinned to a core. The calling thread serves c->server, the other loops stop when it returns.
+ */
+bool run_sharded_event_loops(Cerver *c, int port) {
+	size_t n = c->nlisteners;
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus <= 0) {
+		ncpus = 1;
+	}
+	// steering sends CPU i to listener i, loops past the last CPU would never get a connection
+	if (c->steer_cpu && n > (size_t) ncpus) {
+		n = ncpus;
+	}
+
+	int *servers = calloc(n, sizeof(int));
+	pthread_t *threads = calloc(n, sizeof(pthread_t));
+	ListenerInfo *linfos = calloc(n, sizeof(ListenerInfo));
+	if (servers == NULL || threads == NULL || linfos == NULL) {
+		free(servers);
+		free(threads);
+		free(linfos);
+		return false;
+	}
+
+	size_t nthreads = 1;
+	bool success = true;
+	servers[0] = c->server;
+	for (size_t i = 1; i < n; i++) {
+		servers[i] = open_listener(port);
+		if (servers[i] == -1) {
+			success = false;
+			n = i;
+			break;
+		}
+	}
+	// with fewer listeners than CPUs some CPUs have no loop of their own, the filter would only move their
+	// connections to a loop pinned elsewhere, so the kernel's usual hash is kept instead
+	if (success && c->steer_cpu && n < (size_t) ncpus) {
+		debug("Not steering by CPU: %zu listeners for %ld CPUs", n, ncpus);
+	}
+	else if (success && c->steer_cpu && !attach_reuseport_cbpf(servers[0], n)) {
+		debug("%s", "Failed to attach the reuseport CPU steering program");
+	}
+
+	// loops inherit a blocked signal mask so signals (e.g. SIGINT) keep reaching the calling thread
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (size_t i = 1; success && i < n; i++) {
+		linfos[i] = (ListenerInfo) { .c = c, .server = servers[i] };
+		if (pthread_create(&threads[i], NULL, listener_main, &linfos[i]) != 0) {
+			success = false;
+			break;
+		}
+		nthreads += 1;
+		if (!pin_thread(threads[i], i % ncpus)) {
+			debug("Failed to pin listener %zu", i);
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	cpu_set_t affinity;
+	bool has_affinity = pthread_getaffinity_np(pthread_self(), sizeof(affinity), &affinity) == 0;
+	if (success) {
+		pin_thread(pthread_self(), 0);
+		success = run_event_loop(c, servers[0]);
+	}
+	if (has_affinity) {
+		pthread_setaffinity_np(pthread_self(), sizeof(affinity), &affinity);
+	}
+
+	for (size_t i = 1; i < n; i++) {
+		shutdown(servers[i], SHUT_RDWR);	// wakes up the loop with EPOLLHUP on its listener
+		if (i < nthreads) {
+			pthread_join(threads[i], NULL);
+		}
+		close(servers[i]);
+	}
+
+	free(servers);
+	free(threads);
+	free(linfos);
+	return success;
+}
+
+#endif // EVENT_LOOP_H
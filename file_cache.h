@@ -0,0 +1,314 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stdatomic.h>
+
+#define FILE_CACHE_SHARDS 16					// independently locked parts, picked by the path hash
+#define FILE_CACHE_BUCKETS 64					// hash buckets per shard
+#define FILE_CACHE_BUDGET (64 << 20)			// bytes of content kept across all shards
+#define FILE_CACHE_MAX_FILE (1 << 20)			// larger files are not cached but sent with sendfile
+
+#ifdef linux
+typedef struct CachedFile {
+	char *path;
+	size_t hash;
+	GString content;
+	char content_type[64];
+	char etag[VALIDATOR_LEN];
+	char last_modified[VALIDATOR_LEN];
+
+	// the stat snapshot the content was read with, the entry is stale once the file differs from it
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+
+	atomic_size_t refs;						// one for the cache while the entry is listed, one per reader
+	struct CachedFile *next;				// hash chain
+	struct CachedFile *lru_prev;			// least recently used first
+	struct CachedFile *lru_next;
+} CachedFile;
+
+typedef struct {
+	pthread_mutex_t lock;
+	CachedFile *buckets[FILE_CACHE_BUCKETS];
+	CachedFile *lru_head;
+	CachedFile *lru_tail;
+	size_t bytes;
+} FileCacheShard;
+
+typedef struct {
+	pthread_once_t once;
+	FileCacheShard shards[FILE_CACHE_SHARDS];
+} FileCache;
+
+FileCache file_cache = { .once = PTHREAD_ONCE_INIT };
+
+void file_cache_init(void) {
+	for (size_t i = 0; i < FILE_CACHE_SHARDS; i++) {
+		pthread_mutex_init(&file_cache.shards[i].lock, NULL);
+	}
+}
+
+// FNV-1a
+size_t file_cache_hash(const char *path) {
+	size_t hash = 14695981039346656037ULL;
+	for (const char *p = path; *p != '\0'; p++) {
+		hash = (hash ^ (unsigned char) *p) * 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+bool cached_file_fresh(const CachedFile *cf, const struct stat *st) {
+	return cf->dev == st->st_dev && cf->ino == st->st_ino && cf->size == st->st_size &&
+		cf->mtime.tv_sec == st->st_mtim.tv_sec && cf->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+void cached_file_unref(CachedFile *cf) {
+	if (atomic_fetch_sub(&cf->refs, 1) == 1) {
+		gstr_free(&cf->content);
+		free(cf->path);
+		free(cf);
+	}
+}
+
+// SharedBody.release of a response sending cf->content
+void cached_file_release(void *cf) {
+	cached_file_unref((CachedFile*) cf);
+}
+
+void file_cache_lru_remove(FileCacheShard *shard, CachedFile *cf) {
+	if (cf->lru_prev != NULL) {
+		cf->lru_prev->lru_next = cf->lru_next;
+	}
+	else {
+		shard->lru_head = cf->lru_next;
+	}
+	if (cf->lru_next != NULL) {
+		cf->lru_next->lru_prev = cf->lru_prev;
+	}
+	else {
+		shard->lru_tail = cf->lru_prev;
+	}
+	cf->lru_prev = cf->lru_next = NULL;
+}
+
+void file_cache_lru_push(FileCacheShard *shard, CachedFile *cf) {
+	cf->lru_prev = shard->lru_tail;
+	cf->lru_next = NULL;
+	if (shard->lru_tail != NULL) {
+		shard->lru_tail->lru_next = cf;
+	}
+	else {
+		shard->lru_head = cf;
+	}
+	shard->lru_tail = cf;
+}
+
+// Unlists the entry, readers still holding it keep it alive. The shard lock must be held
+void file_cache_remove(FileCacheShard *shard, CachedFile *cf) {
+	CachedFile **link = &shard->buckets[cf->hash % FILE_CACHE_BUCKETS];
+	while (*link != cf) {
+		link = &(*link)->next;
+	}
+	*link = cf->next;
+	file_cache_lru_remove(shard, cf);
+	shard->bytes -= cf->content.len;
+	cached_file_unref(cf);
+}
+
+// Reads a file into a new entry, NULL if it changed while being read or is too large
+CachedFile *cached_file_load(const char *path, size_t hash, const char *content_type) {
+	int file = open(path, O_RDONLY | O_CLOEXEC);
+	if (file == -1) {
+		return NULL;
+	}
+
+	struct stat st;
+	CachedFile *cf = NULL;
+	if (!regular_file(file, &st) || st.st_size > FILE_CACHE_MAX_FILE || (cf = calloc(1, sizeof(CachedFile))) == NULL) {
+		close(file);
+		return NULL;
+	}
+
+	size_t size = st.st_size, done = 0;
+	cf->path = strdup(path);
+	bool success = cf->path != NULL && (size == 0 || gstr_reserve_exact(&cf->content, size));
+	while (success && done < size) {
+		ssize_t n = pread(file, cf->content.ptr + done, size - done, done);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		success = n > 0;
+		done += success ? n : 0;
+	}
+	struct stat after;
+	success = success && fstat(file, &after) == 0 && after.st_size == st.st_size &&
+		after.st_mtim.tv_sec == st.st_mtim.tv_sec && after.st_mtim.tv_nsec == st.st_mtim.tv_nsec;
+	close(file);
+	if (!success) {
+		gstr_free(&cf->content);
+		free(cf->path);
+		free(cf);
+		return NULL;
+	}
+
+	cf->content.len = size;
+	cf->hash = hash;
+	cf->dev = st.st_dev;
+	cf->ino = st.st_ino;
+	cf->size = st.st_size;
+	cf->mtime = st.st_mtim;
+	if (content_type == NULL) {
+		content_type = find_file_mime((Slice) { .ptr = cf->content.ptr, .len = size < MIME_SNIFF_LEN ? size : MIME_SNIFF_LEN }, size);
+	}
+	snprintf(cf->content_type, sizeof(cf->content_type), "%s", content_type);
+	file_validators(&st, cf->etag, cf->last_modified);
+	atomic_init(&cf->refs, 1);
+	return cf;
+}
+
+/*
+ * The cached content of `path` if it still matches `st`, reloaded otherwise. The caller owns a reference
+ * and releases it with cached_file_unref(). NULL if the file can't be cached.
+ */
+CachedFile *file_cache_get(const char *path, const struct stat *st, const char *content_type) {
+	pthread_once(&file_cache.once, file_cache_init);
+	size_t hash = file_cache_hash(path);
+	FileCacheShard *shard = &file_cache.shards[hash % FILE_CACHE_SHARDS];
+
+	pthread_mutex_lock(&shard->lock);
+	CachedFile *cf = shard->buckets[hash % FILE_CACHE_BUCKETS];
+	while (cf != NULL && (cf->hash != hash || strcmp(cf->path, path) != 0)) {
+		cf = cf->next;
+	}
+	if (cf != NULL && cached_file_fresh(cf, st) && (content_type == NULL || strcmp(cf->content_type, content_type) == 0)) {
+		atomic_fetch_add(&cf->refs, 1);
+		file_cache_lru_remove(shard, cf);
+		file_cache_lru_push(shard, cf);
+		pthread_mutex_unlock(&shard->lock);
+		return cf;
+	}
+	if (cf != NULL) {
+		file_cache_remove(shard, cf);
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	// read without the lock, a concurrent load of the same file is dropped below
+	cf = cached_file_load(path, hash, content_type);
+	if (cf == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&shard->lock);
+	CachedFile **link = &shard->buckets[hash % FILE_CACHE_BUCKETS];
+	while (*link != NULL && ((*link)->hash != hash || strcmp((*link)->path, path) != 0)) {
+		link = &(*link)->next;
+	}
+	if (*link != NULL) {
+		file_cache_remove(shard, *link);
+	}
+	cf->next = shard->buckets[hash % FILE_CACHE_BUCKETS];
+	shard->buckets[hash % FILE_CACHE_BUCKETS] = cf;
+	file_cache_lru_push(shard, cf);
+	shard->bytes += cf->content.len;
+	while (shard->bytes > FILE_CACHE_BUDGET / FILE_CACHE_SHARDS && shard->lru_head != cf) {
+		file_cache_remove(shard, shard->lru_head);
+	}
+	atomic_fetch_add(&cf->refs, 1);
+	pthread_mutex_unlock(&shard->lock);
+	return cf;
+}
+#endif
+
+/*
+ * Answers with a static file kept in memory: 304 when the client's copy is current, else the content
+ * with its validators. The file is stat'ed on every request and reloaded once it changed; files over
+ * FILE_CACHE_MAX_FILE are sent like file() does, without a download name. `content_type` NULL sniffs it.
+ * Returns false, with a 404 set, when there is no such file.
+ */
+bool static_file(Context *ctx, int status_code, const char *filepath, const char *content_type) {
+	ctx->response->body.len = 0;
+	release_shared_body(&ctx->response->shared);
+	shashmap_clear(&ctx->response->headers);
+
+#ifdef linux
+	struct stat st;
+	if (stat(filepath, &st) == -1 || !S_ISREG(st.st_mode)) {
+		ctx->status_code = 404;
+		return false;
+	}
+
+	CachedFile *cf = st.st_size <= FILE_CACHE_MAX_FILE ? file_cache_get(filepath, &st, content_type) : NULL;
+	if (cf == NULL) {
+		int file = open(filepath, O_RDONLY | O_CLOEXEC);
+		if (file == -1 || !regular_file(file, &st)) {
+			if (file != -1) {
+				close(file);
+			}
+			ctx->status_code = 404;
+			return false;
+		}
+
+		if (content_type == NULL) {
+			char head[MIME_SNIFF_LEN + 1] = {0};
+			ssize_t head_len = pread(file, head, MIME_SNIFF_LEN, 0);
+			content_type = find_file_mime((Slice) { .ptr = head, .len = head_len > 0 ? head_len : 0 }, st.st_size);
+		}
+		file_response(ctx, status_code, file, &st, content_type);
+		return true;
+	}
+
+	ctx->status_code = status_code;
+	set_response_header(ctx, "Content-Type", "%s", cf->content_type);
+	set_response_header(ctx, "ETag", "%s", cf->etag);
+	set_response_header(ctx, "Last-Modified", "%s", cf->last_modified);
+	if (status_code == 200 && not_modified(ctx, cf->etag, cf->mtime.tv_sec)) {
+		ctx->status_code = 304;
+	}
+	else if (cf->content.len > 0) {
+		// the content is sent from the cache, the response keeps the entry alive until it went out
+		ctx->response->shared = (SharedBody) {
+			.data = { .ptr = cf->content.ptr, .len = cf->content.len },
+			.owner = cf,
+			.release = cached_file_release,
+		};
+		return true;
+	}
+	cached_file_unref(cf);
+	return true;
+#else
+	FILE *f = fopen(filepath, "rb");
+	if (f == NULL) {
+		ctx->status_code = 404;
+		return false;
+	}
+	ctx->status_code = status_code;
+	gstr_append_fmt(&ctx->response->body, "%F", f);
+	fclose(f);
+
+	if (content_type == NULL) {
+		content_type = find_mime((Slice) { .ptr = ctx->response->body.ptr, .len = ctx->response->body.len });
+	}
+	set_response_header(ctx, "Content-Type", "%s", content_type);
+	return true;
+#endif
+}
+
+// Drops every entry, responses still holding one keep it until they release it
+void free_file_cache(void) {
+#ifdef linux
+	pthread_once(&file_cache.once, file_cache_init);
+	for (size_t i = 0; i < FILE_CACHE_SHARDS; i++) {
+		FileCacheShard *shard = &file_cache.shards[i];
+		pthread_mutex_lock(&shard->lock);
+		while (shard->lru_head != NULL) {
+			file_cache_remove(shard, shard->lru_head);
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+#endif
+}
+
+#endif // FILE_CACHE_H
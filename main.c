@@ -1,6 +1,6 @@
+#include "cerver.h"
 #include <errno.h>
 #include <signal.h>
-#include "cerver.h"
 
 #define PORT 12345
 
@@ -34,42 +34,24 @@ int page404(Context *ctx) {
 		return 0;
 	}
 
-	FILE *f = fopen("404.html", "rb");
-	if (f == NULL) {
+	if (!static_file(ctx, 404, "404.html", "text/html")) {
 		no_content(ctx, 404);
-		return 0;
 	}
-
-	html(ctx, 404, "%F", f);
-
-	fclose(f);
 	return 0;
 }
 
 int homepage(Context *ctx) {
 	const char *index_html = "index.html";
-	FILE *f = fopen(index_html, "rb");
-	if (f == NULL) {
+	if (!static_file(ctx, 200, index_html, "text/html")) {
 		html(ctx, 200, "Placing %s in this folder", index_html);
-		return 0;
 	}
-
-	html(ctx, 200, "%F", f);
-
-	fclose(f);
 	return 0;
 }
 
 int favicon(Context *ctx) {
-	FILE *f = fopen("favicon.ico", "rb");
-	if (f == NULL) {
+	if (!static_file(ctx, 200, "favicon.ico", "image/x-icon")) {
 		no_content(ctx, 404);
-		return 0;
 	}
-
-	stream(ctx, 200, "image/x-icon", f);
-
-	fclose(f);
 	return 0;
 }
 
@@ -185,6 +167,36 @@ int upload(Context *ctx) {
 	return 0;
 }
 
+// Writes the body to temp/:name as it arrives, without holding the whole file in memory
+int store(Context *ctx) {
+	Slice name = path_param(ctx, "name");
+	GString path = gstr_from_cstr("temp/");
+	gstr_append_fmt_null(&path, "%Sl", name);
+
+	FILE *f = fopen(path.ptr, "wb");
+	gstr_free(&path);
+	if (f == NULL) {
+		html(ctx, 400, "%s", strerror(errno));
+		return 0;
+	}
+
+	char buffer[16384];
+	size_t total = 0;
+	ssize_t nbytes = 0;
+	while ((nbytes = read_body(ctx, buffer, sizeof(buffer))) > 0) {
+		fwrite(buffer, nbytes, 1, f);
+		total += nbytes;
+	}
+	fclose(f);
+
+	if (nbytes < 0) {
+		html(ctx, 400, "Incomplete body");
+		return 0;
+	}
+	html(ctx, 200, "%Sl: %ld bytes stored", name, total);
+	return 0;
+}
+
 int xinchao(Context *ctx) {
 	Slice name = path_param(ctx, "name");
 	html(ctx, 200, "<!DOCTYPE html>"
@@ -208,12 +220,15 @@ int main(void) {
 	register_route(&c, "GET", page404);
 	post(c, "/concat", concat);
 	post(c, "/upload", upload);
+	post_stream(c, "/store/:name", store);
 	get(c, "/xinchao/:name", xinchao);
 	if (!run(&c, PORT)) {
 		debug("%s", strerror(errno));
+		free_file_cache();
 		return 1;
 	}
 
+	free_file_cache();
 	return 0;
 }
 
@@ -12,6 +12,7 @@
 #endif
 
 #define MAX_PLAIN_TEXT_LEN 10240
+#define MIME_SNIFF_LEN 512		// bytes read from the start of a file to guess its type
 #define FF "\xff"
 #define DF "\xdf"
 #define ZZ "\x00"
@@ -236,4 +237,14 @@ const char *find_mime(Slice input) {
 	return "application/octet-stream";
 }
 
+// Type of a file of `len` bytes guessed from its first bytes `head`, the file itself isn't loaded
+const char *find_file_mime(Slice head, size_t len) {
+	const char *type = find_mime(head);
+	if (len >= MAX_PLAIN_TEXT_LEN && strcmp(type, "plain/text") == 0) {
+		return "application/octet-stream";
+	}
+
+	return type;
+}
+
 #endif // MIME_H
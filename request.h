@@ -1,20 +1,130 @@
 #ifndef REQUEST_H
 #define REQUEST_H
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#define MAX_REQUEST_HEADER_LEN 8192
+#define REQUEST_INCOMPLETE -1
+
 #define NEWLINE 			"\r\n"
 #define DASH_DASH			"--"
 #define NEWLINE_DASH_DASH 	NEWLINE DASH_DASH
 
-#define query_param(ctx, key) find_key_in_pairs(&(ctx)->request->query_parameters, slice_cstr(key))
+#define query_param(ctx, key) find_key_in_pairs(request_query((ctx)->request), slice_cstr(key))
 #define path_param(ctx, key) find_key_in_pairs(&(ctx)->request->path_parameters, slice_cstr(key))
-#define form_value(ctx, key) find_key_in_pairs(&(ctx)->request->form_values, slice_cstr(key))
-#define form_file(ctx, key) find_key_in_multipart_form(&(ctx)->request->multipart_form, slice_cstr(key));
-#define request_header(ctx, key) find_key_in_pairs(&(ctx)->request->headers, slice_cstr(key))
+#define form_value(ctx, key) find_key_in_pairs(request_form((ctx)->request), slice_cstr(key))
+#define form_file(ctx, key) find_key_in_multipart_form(request_multipart((ctx)->request), slice_cstr(key))
+#define request_header(ctx, key) find_header((ctx)->request, slice_cstr(key))
+#define known_request_header(ctx, header) request_known_header((ctx)->request, header)
+
+#define KNOWN_HEADER_HASH_SIZE 32
+
+// Lowercase names, indexed by KnownHeader
+const Slice known_header_names[HEADER_COUNT] = {
+	slice_bytes("host"),
+	slice_bytes("content-length"),
+	slice_bytes("content-type"),
+	slice_bytes("connection"),
+	slice_bytes("accept"),
+	slice_bytes("accept-encoding"),
+	slice_bytes("accept-language"),
+	slice_bytes("cookie"),
+	slice_bytes("transfer-encoding"),
+	slice_bytes("if-none-match"),
+	slice_bytes("if-modified-since"),
+	slice_bytes("if-range"),
+	slice_bytes("range"),
+	slice_bytes("user-agent"),
+	slice_bytes("expect"),
+	slice_bytes("authorization"),
+	slice_bytes("upgrade"),
+	slice_bytes("origin"),
+	slice_bytes("referer"),
+};
+
+// Perfect hash of the names above (no two share a bucket), KnownHeader + 1 per bucket
+const unsigned char known_header_buckets[KNOWN_HEADER_HASH_SIZE] = {
+	[12] = HEADER_HOST + 1,
+	[7] = HEADER_CONTENT_LENGTH + 1,
+	[18] = HEADER_CONTENT_TYPE + 1,
+	[1] = HEADER_CONNECTION + 1,
+	[25] = HEADER_ACCEPT + 1,
+	[20] = HEADER_ACCEPT_ENCODING + 1,
+	[30] = HEADER_ACCEPT_LANGUAGE + 1,
+	[22] = HEADER_COOKIE + 1,
+	[27] = HEADER_TRANSFER_ENCODING + 1,
+	[19] = HEADER_IF_NONE_MATCH + 1,
+	[26] = HEADER_IF_MODIFIED_SINCE + 1,
+	[16] = HEADER_IF_RANGE + 1,
+	[11] = HEADER_RANGE + 1,
+	[21] = HEADER_USER_AGENT + 1,
+	[29] = HEADER_EXPECT + 1,
+	[13] = HEADER_AUTHORIZATION + 1,
+	[2] = HEADER_UPGRADE + 1,
+	[5] = HEADER_ORIGIN + 1,
+	[14] = HEADER_REFERER + 1,
+};
+
+// Classifies a lowercase header name with one hash and one compare
+KnownHeader known_header(Slice key) {
+	if (key.len == 0) {
+		return HEADER_UNKNOWN;
+	}
+
+	unsigned char first = key.ptr[0], last = key.ptr[key.len - 1];
+	size_t bucket = (key.len * 26 + first + last * 11) & (KNOWN_HEADER_HASH_SIZE - 1);
+	int header = known_header_buckets[bucket] - 1;
+	if (header < 0 || !slice_equal(known_header_names[header], key)) {
+		return HEADER_UNKNOWN;
+	}
+
+	return header;
+}
+
+Slice request_known_header(const Request *req, KnownHeader header) {
+	if (header >= HEADER_COUNT || req->known_headers[header] == 0) {
+		return (Slice) {0};
+	}
 
-Pairs parse_pairs(Slice content, const char *pair_delimiter, const char *delimiter) {
-	Pairs pairs = {0};
+	return req->headers.values[req->known_headers[header] - 1];
+}
+
+// Value of the first header named `key` (lowercase), known headers don't need a scan
+Slice find_header(const Request *req, Slice key) {
+	KnownHeader header = known_header(key);
+	if (header != HEADER_UNKNOWN) {
+		return request_known_header(req, header);
+	}
+
+	return find_key_in_pairs(&req->headers, key);
+}
+
+const Slice http_method_names[METHOD_COUNT] = {
+	[METHOD_GET] = slice_bytes("GET"),
+	[METHOD_HEAD] = slice_bytes("HEAD"),
+	[METHOD_POST] = slice_bytes("POST"),
+	[METHOD_PUT] = slice_bytes("PUT"),
+	[METHOD_DELETE] = slice_bytes("DELETE"),
+	[METHOD_PATCH] = slice_bytes("PATCH"),
+	[METHOD_OPTIONS] = slice_bytes("OPTIONS"),
+	[METHOD_CONNECT] = slice_bytes("CONNECT"),
+	[METHOD_TRACE] = slice_bytes("TRACE"),
+};
+
+// Methods are case-sensitive
+HttpMethod parse_method(Slice method) {
+	for (size_t i = 0; i < METHOD_COUNT; i++) {
+		if (slice_equal(http_method_names[i], method)) {
+			return i;
+		}
+	}
+
+	return METHOD_UNKNOWN;
+}
+
+Pairs parse_pairs(Arena *arena, Slice content, const char *pair_delimiter, const char *delimiter) {
+	Pairs pairs = { .arena = arena };
 	while (content.len > 0) {
 		size_t pde_idx = slice_cspn(content, pair_delimiter);
 		size_t de_idx = slice_cspn(content, delimiter);
@@ -22,10 +132,7 @@ Pairs parse_pairs(Slice content, const char *pair_delimiter, const char *delimit
 
 		if (de_idx < pde_idx) {
 			key_len = de_idx;
-			val_len = pde_idx - key_len;
-			if (pde_idx < content.len) {
-				val_len--;
-			}
+			val_len = pde_idx - key_len - 1;
 		}
 		Slice key = (Slice) { .ptr = content.ptr, .len = key_len };
 		Slice val = (Slice) { .ptr = content.ptr + key_len + 1, .len = val_len };
@@ -37,18 +144,61 @@ Pairs parse_pairs(Slice content, const char *pair_delimiter, const char *delimit
 	return pairs;
 }
 
-bool is_content_disposition_delimiter(Slice s, Slice boundary) {
-	if (slice_strstr(s, NEWLINE_DASH_DASH) != s.ptr) {
-		return false;
+int hex_digit(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+
+	return -1;
+}
+
+/*
+ * Decodes %XX and '+' in place, returns the decoded length. Runs without either byte are skipped with
+ * simd_find_any and moved as a block, a malformed escape is kept as is.
+ */
+size_t url_decode(char *s, size_t len) {
+	size_t i = simd_find_any(s, len, "%+", 2);
+	size_t out = i;
+	while (i < len) {
+		int hi, lo;
+		if (s[i] == '+') {
+			s[out++] = ' ';
+			i += 1;
+		}
+		else if (i + 2 < len && (hi = hex_digit(s[i + 1])) >= 0 && (lo = hex_digit(s[i + 2])) >= 0) {
+			s[out++] = (char) (hi << 4 | lo);
+			i += 3;
+		}
+		else {
+			s[out++] = s[i++];
+		}
+
+		size_t run = simd_find_any(s + i, len - i, "%+", 2);
+		memmove(s + out, s + i, run);
+		out += run;
+		i += run;
 	}
 
-	s = slice_advanced(s, sizeof(NEWLINE_DASH_DASH) - 1);
-	if (strncmp(s.ptr, boundary.ptr, boundary.len) != 0) {
-		return false;
+	return out;
+}
+
+/*
+ * Splits an application/x-www-form-urlencoded string and decodes keys and values in place, so lookups
+ * compare decoded keys. `content` must point into memory the request owns (its arena), the raw bytes are
+ * overwritten.
+ */
+Pairs parse_urlencoded(Arena *arena, Slice content) {
+	Pairs pairs = parse_pairs(arena, content, "&", "=");
+	for (size_t i = 0; i < pairs.len; i++) {
+		pairs.keys[i].len = url_decode((char*) pairs.keys[i].ptr, pairs.keys[i].len);
+		pairs.values[i].len = url_decode((char*) pairs.values[i].ptr, pairs.values[i].len);
 	}
 
-	s = slice_advanced(s, boundary.len);
-	return slice_strstr(s, NEWLINE) == s.ptr || slice_strstr(s, DASH_DASH) == s.ptr;
+	return pairs;
 }
 
 bool append_form_file(MultipartForm *mtform, Slice key, Slice name, Slice content) {
@@ -64,25 +214,27 @@ bool append_form_file(MultipartForm *mtform, Slice key, Slice name, Slice conten
 				return false;
 			}
 
-			Slice *new_keys = realloc(mtform->keys, new_cap*sizeof(Slice));
+			Slice *new_keys = arena_realloc(mtform->arena, mtform->keys, mtform->capacity*sizeof(Slice), new_cap*sizeof(Slice));
 			if (new_keys == NULL) {
 				return false;
 			}
 			mtform->keys = new_keys;
 
-			FormFile *new_form_files = realloc(mtform->form_files, new_cap*sizeof(FormFile));
+			FormFile *new_form_files = arena_realloc(mtform->arena, mtform->form_files, mtform->capacity*sizeof(FormFile), new_cap*sizeof(FormFile));
 			if (new_form_files == NULL) {
 				return false;
 			}
 			mtform->form_files = new_form_files;
+			mtform->capacity = new_cap;
 		}
 		mtform->keys[mtform->nkeys] = key;
 		FormFile ff = {
-			.pairs = calloc(1, sizeof(Pairs)),
+			.pairs = arena_calloc(mtform->arena, 1, sizeof(Pairs)),
 		};
 		if (ff.pairs == NULL) {
 			return false;
 		}
+		ff.pairs->arena = mtform->arena;
 		mtform->form_files[mtform->nkeys] = ff;
 		mtform->nkeys += 1;
 	}
@@ -91,36 +243,37 @@ bool append_form_file(MultipartForm *mtform, Slice key, Slice name, Slice conten
 	return true;
 }
 
+/*
+ * Walks the body from delimiter to delimiter ("\r\n--" boundary) in a single pass:
+ * --boundary\r\n <part headers> \r\n\r\n <content> \r\n--boundary\r\n ... \r\n--boundary--
+ */
 void parse_multipart_form(Request *req, Slice boundary) {
 	static char content_disposition[] = "Content-Disposition: form-data; name=\"";
 	static char filename[] = "filename=\"";
 
-	Slice form_name = {0}, file_name = {0}, file_content = {0};
+	Needle delimiter = {0};
+	if (!needle_init(&delimiter, slice_bytes(NEWLINE_DASH_DASH), boundary)) {
+		trace_log;
+		return;
+	}
+
+	// the first delimiter usually starts the body, so it has no CRLF in front
 	Slice body = req->body;
-	while (body.len > 0) {
-		if (form_name.len > 0) {
-			if (file_name.len > 0) {
-				// debug("%s", "multipart");
-				append_form_file(&req->multipart_form, form_name, file_name, file_content);
-				file_name.len = 0;
-			}
-			else {
-				// debug("%s", "form value");
-				append_pair(&req->form_values, form_name, file_content);
-			}
-			form_name.len = 0;
-		}
-		const char *delimiter = slice_strstr(body, DASH_DASH);
-		if (delimiter == NULL) {
-			// trace_log;
-			break;
-		}
-		body = slice_advanced(body, delimiter - body.ptr + strlen(DASH_DASH));
-		if (slice_slice(body, boundary) != body.ptr) {
-			// trace_log;
-			continue;
+	Slice first_delimiter = slice_advanced(delimiter.pattern, strlen(NEWLINE));
+	if (body.len >= first_delimiter.len && memcmp(body.ptr, first_delimiter.ptr, first_delimiter.len) == 0) {
+		body = slice_advanced(body, first_delimiter.len);
+	}
+	else {
+		const char *iter = needle_find(&delimiter, body);
+		if (iter == NULL) {
+			trace_log;
+			needle_free(&delimiter);
+			return;
 		}
-		body = slice_advanced(body, boundary.len);
+		body = slice_advanced(body, iter - body.ptr + delimiter.pattern.len);
+	}
+
+	while (body.len > 0) {
 		if (slice_strstr(body, DASH_DASH) == body.ptr) {
 			// debug("%s", "end");
 			break;
@@ -131,22 +284,27 @@ void parse_multipart_form(Request *req, Slice boundary) {
 		}
 		body = slice_advanced(body, strlen(NEWLINE));
 
-		size_t crlf_idx = slice_cspn(body, NEWLINE);
-		Slice line = { .ptr = body.ptr, .len = crlf_idx };
-		const char *iter = slice_strstr(line, content_disposition);
+		const char *crlf_crlf = slice_strstr(body, NEWLINE NEWLINE);
+		if (crlf_crlf == NULL) {
+			trace_log;
+			break;
+		}
+		Slice headers = { .ptr = body.ptr, .len = crlf_crlf - body.ptr + strlen(NEWLINE) };
+		const char *iter = slice_strstr(headers, content_disposition);
 		if (iter == NULL) {
 			trace_log;
 			break;
 		}
-		line = slice_advanced(line, iter - line.ptr + sizeof(content_disposition) - 1);
+		Slice line = slice_advanced(headers, iter - headers.ptr + sizeof(content_disposition) - 1);
+		line.len = slice_cspn(line, NEWLINE);
 
 		size_t quote_idx = slice_cspn(line, "\"");
-		if (line.ptr[quote_idx] != '"') {
+		if (quote_idx == line.len) {
 			trace_log;
 			break;
 		}
 
-		form_name = (Slice) { .ptr = line.ptr, .len = quote_idx };
+		Slice form_name = { .ptr = line.ptr, .len = quote_idx }, file_name = {0};
 		// debug("%.*s", (int) form_name.len, form_name.ptr);
 		iter = slice_strstr(line, "; ");
 		if (iter != NULL) {
@@ -157,10 +315,10 @@ void parse_multipart_form(Request *req, Slice boundary) {
 				trace_log;
 				break;
 			}
-			line = slice_advanced(line, iter - line.ptr + sizeof(filename) - 1);
+			line = slice_advanced(line, sizeof(filename) - 1);
 
 			quote_idx = slice_cspn(line, "\"");
-			if (line.ptr[quote_idx] != '"') {
+			if (quote_idx == line.len) {
 				trace_log;
 				break;
 			}
@@ -172,156 +330,236 @@ void parse_multipart_form(Request *req, Slice boundary) {
 			trace_log;
 			break;
 		}
-		const char *crlf_crlf = slice_strstr(body, NEWLINE NEWLINE);
-		body = slice_advanced(body, crlf_crlf - body.ptr + strlen(NEWLINE)*2);
-		file_content.ptr = body.ptr;
 
-		const char *newline_dd = slice_strstr(body, NEWLINE_DASH_DASH);
-		if (newline_dd == NULL) {
+		body = slice_advanced(body, headers.len + strlen(NEWLINE));
+		iter = needle_find(&delimiter, body);
+		if (iter == NULL) {
 			trace_log;
 			break;
 		}
-		body = slice_advanced(body, newline_dd - body.ptr);
-		while (body.len > 0 && !is_content_disposition_delimiter(body, boundary)) {
-			body = slice_advanced(body, strlen(NEWLINE_DASH_DASH));
-			newline_dd = slice_strstr(body, NEWLINE_DASH_DASH);
-			if (newline_dd == NULL) {
-				trace_log;
-				break;
-			}
-			body = slice_advanced(body, newline_dd - body.ptr);
+		Slice content = { .ptr = body.ptr, .len = iter - body.ptr };
+		if (file_name.len > 0) {
+			// debug("%s", "multipart");
+			append_form_file(&req->multipart_form, form_name, file_name, content);
 		}
-		file_content.len = body.ptr - file_content.ptr;
-		body = slice_advanced(body, strlen(NEWLINE));
+		else {
+			// debug("%s", "form value");
+			append_pair(&req->form_values, form_name, content);
+		}
+		body = slice_advanced(body, content.len + delimiter.pattern.len);
 	}
 
-	req->multipart_form.boundary = boundary;
+	needle_free(&delimiter);
 }
 
-int parse_request(Request *req) {
-	char *raw = req->arena.ptr;
-	size_t raw_len = req->arena.len;
+void rebase_slice(Slice *s, uintptr_t from, uintptr_t to) {
+	if (s->ptr != NULL) {
+		s->ptr = (const char*) (to + ((uintptr_t) s->ptr - from));
+	}
+}
 
-	int state = HTTP_METHOD;
-	Slice slice = { .ptr = raw };
-	Slice key = {0}, val = {0};
-	bool fail = false;
-	Slice content_type = {0};
+// The buffer holding a partially parsed request was reallocated, move every parsed slice along
+void rebase_request(Request *req, const char *buffer) {
+	uintptr_t from = (uintptr_t) req->parser.base, to = (uintptr_t) buffer;
+	req->parser.base = buffer;
+	if (from == 0 || from == to) {
+		return;
+	}
 
-	for (size_t i = 0; i < raw_len; i++) {
-		switch (state) {
+	rebase_slice(&req->method, from, to);
+	rebase_slice(&req->path, from, to);
+	rebase_slice(&req->http_version, from, to);
+	for (size_t i = 0; i < req->headers.len; i++) {
+		rebase_slice(&req->headers.keys[i], from, to);
+		rebase_slice(&req->headers.values[i], from, to);
+	}
+}
+
+// 400 unless the value is a plain number, 413 if it doesn't fit in a size_t
+int parse_content_length(Slice val, size_t *content_length) {
+	if (val.len == 0) {
+		return 400;
+	}
+
+	size_t n = 0;
+	for (size_t i = 0; i < val.len; i++) {
+		if (!isdigit(val.ptr[i])) {
+			return 400;
+		}
+		size_t digit = val.ptr[i] - '0';
+		if (n > (SIZE_MAX - digit) / 10) {
+			return 413;
+		}
+		n = n * 10 + digit;
+	}
+	*content_length = n;
+	return 0;
+}
+
+/*
+ * Parses the request line and the headers of `raw`, resuming where the previous call stopped so a head
+ * that arrives over many reads is scanned once. Every state jumps straight to its next delimiter with
+ * simd_find_any(). Returns 0 once the empty line is reached (state HTTP_BODY), REQUEST_INCOMPLETE if more
+ * bytes are needed, or the status code of the error.
+ */
+int parse_request_head(Request *req, char *raw, size_t raw_len) {
+	RequestParser *p = &req->parser;
+	rebase_request(req, raw);
+
+	if (p->error != 0) {
+		return p->error;
+	}
+
+	size_t i = p->pos;
+	while (i < raw_len && p->state != HTTP_BODY) {
+		switch (p->state) {
 			case HTTP_METHOD: {
-				if (raw[i] == ' ') {
-					req->method = slice;
-					slice = (Slice) { .ptr = raw + i + 1 };
-					state = HTTP_PATH;
-				}
-				else {
-					slice.len += 1;
+				i += simd_find_any(raw + i, raw_len - i, " ", 1);
+				if (i < raw_len) {
+					req->method = (Slice) { .ptr = raw + p->start, .len = i - p->start };
+					req->method_type = parse_method(req->method);
+					p->start = i + 1;
+					p->state = HTTP_PATH;
+					i += 1;
 				}
 				break;
 			}
 			case HTTP_PATH: {
-				if (raw[i] == ' ') {
-					req->path = slice;
-					slice = (Slice) { .ptr = raw + i + 1 };
-					state = HTTP_VERSION;
-				}
-				else {
-					slice.len += 1;
+				i += simd_find_any(raw + i, raw_len - i, " ", 1);
+				if (i < raw_len) {
+					req->path = (Slice) { .ptr = raw + p->start, .len = i - p->start };
+					p->start = i + 1;
+					p->state = HTTP_VERSION;
+					i += 1;
 				}
 				break;
 			}
 			case HTTP_VERSION: {
-				if (raw[i] == '\r') {
-					if (raw[i + 1] != '\n') {
-						fail = true;
-						goto _return;
-					}
-					req->http_version = slice;
-					key = (Slice) { .ptr = raw + i + 2 };
-					state = HTTP_HEADER_KEY;
+				i += simd_find_any(raw + i, raw_len - i, "\r", 1);
+				if (i < raw_len) {
+					req->http_version = (Slice) { .ptr = raw + p->start, .len = i - p->start };
+					p->state = HTTP_LINE_END;
+					i += 1;
 				}
-				else {
-					slice.len += 1;
+				break;
+			}
+			case HTTP_LINE_END: {
+				if (raw[i] != '\n') {
+					return p->error = 400;
 				}
+				i += 1;
+				p->start = i;
+				p->state = HTTP_HEADER_KEY;
 				break;
 			}
 			case HTTP_HEADER_KEY: {
-				if (raw[i] == ':') {
-					if (raw[i + 1] != ' ') {
-						fail = true;
-						goto _return;
-					}
-					val = (Slice) { .ptr = raw + i + 2 };
-					state = HTTP_HEADER_VALUE;
+				if (i == p->start && raw[i] == '\r') {
+					p->state = HTTP_HEADER_END;
+					i += 1;
+					break;
 				}
-				else {
-					if (raw[i] >= 'A' && raw[i] <= 'Z') {
-						raw[i] += 'a' - 'A';
+
+				size_t n = simd_find_any(raw + i, raw_len - i, ":\r\n", 3);
+				simd_lowercase(raw + i, n);
+				i += n;
+				if (i < raw_len) {
+					if (raw[i] != ':') {
+						return p->error = 400;
 					}
-					key.len += 1;
+					p->key_end = i;
+					p->value = i + 1;
+					p->state = HTTP_HEADER_VALUE;
+					i += 1;
 				}
 				break;
 			}
 			case HTTP_HEADER_VALUE: {
-				if (raw[i] == '\r') {
-					if (raw[i + 1] != '\n') {
-						fail = true;
-						goto _return;
+				while (i < raw_len && i == p->value && raw[i] == ' ') {
+					p->value += 1;
+					i += 1;
+				}
+				i += simd_find_any(raw + i, raw_len - i, "\r", 1);
+				if (i < raw_len) {
+					Slice key = { .ptr = raw + p->start, .len = p->key_end - p->start };
+					Slice val = { .ptr = raw + p->value, .len = i - p->value };
+					while (val.len > 0 && val.ptr[val.len - 1] == ' ') {
+						val.len -= 1;
 					}
-					key.len -= 1;
-					val.len -= 1;
 					append_pair(&req->headers, key, val);
 
-					if (slice_equal_cstr(key, "content-type")) {
-						content_type = val;
+					KnownHeader header = known_header(key);
+					if (header == HEADER_CONTENT_LENGTH) {
+						size_t content_length = 0;
+						int status = parse_content_length(val, &content_length);
+						if (status != 0) {
+							return p->error = status;
+						}
+						// repeated lengths must agree, otherwise the body can't be framed (RFC 9112 6.3)
+						if (req->known_headers[header] != 0 && content_length != p->content_length) {
+							return p->error = 400;
+						}
+						p->content_length = content_length;
 					}
-					key = (Slice) { .ptr = raw + i + 2 };
-					state = HTTP_HEADER_KEY;
-					if (raw[i + 2] == '\r' && raw[i + 3] == '\n') {
-						i += 3;
-						state = HTTP_BODY;
+					if (header != HEADER_UNKNOWN && req->known_headers[header] == 0) {
+						req->known_headers[header] = req->headers.len;
 					}
-				}
-				else {
-					val.len += 1;
+					p->state = HTTP_LINE_END;
+					i += 1;
 				}
 				break;
 			}
-			case HTTP_BODY: {
-				slice = (Slice) { .ptr = raw + i, .len = raw_len - i - 1 };
-				req->body = slice;
-				i = raw_len - 1;
+			case HTTP_HEADER_END: {
+				if (raw[i] != '\n') {
+					return p->error = 400;
+				}
+				// chunked bodies aren't decoded, framing them by Content-Length would read the chunks as the next request
+				if (req->known_headers[HEADER_TRANSFER_ENCODING] != 0) {
+					return p->error = req->known_headers[HEADER_CONTENT_LENGTH] != 0 ? 400 : 501;
+				}
+				i += 1;
+				p->header_len = i;
+				p->state = HTTP_BODY;
 				break;
 			}
 		}
 	}
-	if (state != HTTP_BODY) {
-		fail = true;
-		goto _return;
+	p->pos = i;
+
+	// the limit holds however the head was split across reads
+	size_t head_len = p->state == HTTP_BODY ? p->header_len : p->pos;
+	if (head_len > MAX_REQUEST_HEADER_LEN) {
+		return p->error = 431;
+	}
+	return p->state == HTTP_BODY ? 0 : REQUEST_INCOMPLETE;
+}
+
+// Finishes a request whose head and body are in req->arena
+int parse_request(Request *req) {
+	bool fail = false;
+	if (req->parser.state != HTTP_BODY) {
+		int status = parse_request_head(req, req->arena.ptr, req->arena.len);
+		if (status != 0) {
+			return status == REQUEST_INCOMPLETE ? 400 : status;
+		}
 	}
+	rebase_request(req, req->arena.ptr);
+	req->body = (Slice) { .ptr = req->arena.ptr + req->parser.header_len, .len = req->arena.len - req->parser.header_len };
+	Slice content_type = request_known_header(req, HEADER_CONTENT_TYPE);
 
 	size_t hash_idx = slice_cspn(req->path, "#");
 	if (req->path.ptr[hash_idx] == '#') {
 		req->path.len = hash_idx;
 	}
 
-	Slice query_param = {0};
 	size_t question_idx = slice_cspn(req->path, "?");
 	if (req->path.ptr[question_idx] == '?') {
-		query_param = (Slice) { .ptr = req->path.ptr + question_idx + 1, req->path.len - question_idx };
+		req->query = (Slice) { .ptr = req->path.ptr + question_idx + 1, req->path.len - question_idx - 1 };
 		req->path.len = question_idx;
 	}
 
-	if (slice_equal_cstr(req->method, "GET") && query_param.len > 0) {
-		req->query_parameters = parse_pairs(query_param, "&", "=");
-	}
-	else if (slice_equal_cstr(req->method, "POST")) {
-		if (slice_equal_cstr(content_type, "application/x-www-form-urlencoded")) {
-			req->form_values = parse_pairs(req->body, "&", "=");
-		}
-		else if (content_type.ptr != NULL && strncmp(content_type.ptr, "multipart/form-data", 19) == 0) {
+	// only the boundary is checked here, the query and the body are parsed when the handler asks for them
+	if (req->method_type == METHOD_POST) {
+		if (content_type.ptr != NULL && strncmp(content_type.ptr, "multipart/form-data", 19) == 0) {
 			size_t semiconlon_idx = slice_cspn(content_type, ";");
 			size_t equal_idx = slice_cspn(content_type, "=");
 			if (strncmp(content_type.ptr + semiconlon_idx, "; ", 2) != 0 ||
@@ -330,8 +568,7 @@ int parse_request(Request *req) {
 				goto _return;
 			}
 
-			Slice boundary = (Slice) { .ptr = content_type.ptr + equal_idx + 1, .len = content_type.len - equal_idx - 1 };
-			parse_multipart_form(req, boundary);
+			req->multipart_form.boundary = (Slice) { .ptr = content_type.ptr + equal_idx + 1, .len = content_type.len - equal_idx - 1 };
 		}
 	}
 
@@ -339,10 +576,52 @@ _return:
 	return fail ? 400 : 0;
 }
 
+// Query parameters of a GET request, parsed on the first call
+QueryParameter *request_query(Request *req) {
+	if (!(req->parsed & REQUEST_PARSED_QUERY)) {
+		req->parsed |= REQUEST_PARSED_QUERY;
+		if (req->method_type == METHOD_GET && req->query.len > 0) {
+			req->query_parameters = parse_urlencoded(&req->mem, req->query);
+		}
+	}
+
+	return &req->query_parameters;
+}
+
+// Parses an urlencoded or multipart POST body once, both fill form_values
+void parse_request_body(Request *req) {
+	if (req->parsed & REQUEST_PARSED_BODY) {
+		return;
+	}
+	req->parsed |= REQUEST_PARSED_BODY;
+	if (req->method_type != METHOD_POST) {
+		return;
+	}
+
+	if (req->multipart_form.boundary.ptr != NULL) {
+		parse_multipart_form(req, req->multipart_form.boundary);
+	}
+	else if (slice_equal_cstr(request_known_header(req, HEADER_CONTENT_TYPE), "application/x-www-form-urlencoded")) {
+		req->form_values = parse_urlencoded(&req->mem, req->body);
+	}
+}
+
+FormValue *request_form(Request *req) {
+	parse_request_body(req);
+	return &req->form_values;
+}
+
+MultipartForm *request_multipart(Request *req) {
+	parse_request_body(req);
+	return &req->multipart_form;
+}
+
 void print_request(Request *req) {
 	if (req == NULL) {
 		return;
 	}
+	request_query(req);
+	parse_request_body(req);
 
 	debug("Method: %.*s", (int) req->method.len, req->method.ptr);
 	debug("Path: %.*s", (int) req->path.len, req->path.ptr);
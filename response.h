@@ -13,6 +13,12 @@ size_t strput_httpstatus(GString *s, int code) {
 		case 200: {
 			return gstr_append_fmt(s, "HTTP/1.1 200 OK\r\n");
 		}
+		case 206: {
+			return gstr_append_fmt(s, "HTTP/1.1 206 Partial Content\r\n");
+		}
+		case 304: {
+			return gstr_append_fmt(s, "HTTP/1.1 304 Not Modified\r\n");
+		}
 		case 301: {
 			return gstr_append_fmt(s, "HTTP/1.1 301 Moved Permanently\r\n");
 		}
@@ -22,12 +28,27 @@ size_t strput_httpstatus(GString *s, int code) {
 		case 404: {
 			return gstr_append_fmt(s, "HTTP/1.1 404 Not Found\r\n");
 		}
+		case 408: {
+			return gstr_append_fmt(s, "HTTP/1.1 408 Request Timeout\r\n");
+		}
 		case 411: {
 			return gstr_append_fmt(s, "HTTP/1.1 411 Length Required\r\n");
 		}
+		case 413: {
+			return gstr_append_fmt(s, "HTTP/1.1 413 Content Too Large\r\n");
+		}
+		case 416: {
+			return gstr_append_fmt(s, "HTTP/1.1 416 Range Not Satisfiable\r\n");
+		}
 		case 431: {
 			return gstr_append_fmt(s, "HTTP/1.1 431 Request Header Fields Too Large\r\n");
 		}
+		case 501: {
+			return gstr_append_fmt(s, "HTTP/1.1 501 Not Implemented\r\n");
+		}
+		case 503: {
+			return gstr_append_fmt(s, "HTTP/1.1 503 Service Unavailable\r\n");
+		}
 	}
 
 	debug("Unknown status code: %d\n", code);
@@ -54,9 +75,9 @@ void set_response_header(Context *ctx, const char *header, const char *fmt, ...)
 	size_t slot_idx = shashmap_find(headers, &key);
 	if (slot_idx != SHASHMAP_INVALID_SLOT) {
 		size_t header_idx = headers->link[slot_idx];
-		GString value = headers->value[header_idx];
-		gstr_clear(&value);
-		gstr_append_vfmt(&value, fmt, arg);
+		GString *value = &headers->value[header_idx];
+		gstr_clear(value);
+		gstr_append_vfmt(value, fmt, arg);
 	}
 	else {
 		GString value = {0};
@@ -86,30 +107,337 @@ void blob(Context *ctx, int status_code, const char *content_type, const char *b
 	gstr_clear(&ctx->response->body);
 	gstr_append_cstr(&ctx->response->body, blob, blob_len);
 
-	ctx->response->headers.len = 0;
+	shashmap_clear(&ctx->response->headers);
+	set_response_header(ctx, "Content-Type", "%s", content_type);
+}
+
+#ifdef linux
+#define MAX_BYTE_RANGES 16			// a Range header asking for more is ignored and the whole file is sent
+#define MAX_BYTERANGES_LEN (1 << 20)	// multipart/byteranges bodies are read into memory, larger ones get the whole file
+#define BYTERANGES_BOUNDARY_LEN 48
+
+typedef struct {
+	size_t start;
+	size_t len;
+} ByteRange;
+
+// `len` bytes of `file` from `offset` follow the body, sent with sendfile when the response goes out; takes `file`
+void response_file(Context *ctx, int file, size_t offset, size_t len) {
+	Response *resp = ctx->response;
+	close_file(&resp->file, &resp->file_len);
+	if (len == 0) {
+		close(file);
+		return;
+	}
+
+	resp->file = file;
+	resp->file_offset = offset;
+	resp->file_len = len;
+}
+
+// False for anything but a regular file (pipes, directories, ...)
+bool regular_file(int file, struct stat *st) {
+	return fstat(file, st) == 0 && S_ISREG(st->st_mode);
+}
+
+// Decimal number without sign or spaces, false on overflow
+bool parse_decimal(Slice s, size_t *n) {
+	if (s.len == 0) {
+		return false;
+	}
+
+	size_t value = 0;
+	for (size_t i = 0; i < s.len; i++) {
+		if (s.ptr[i] < '0' || s.ptr[i] > '9' || value > ((size_t) -1 - 9) / 10) {
+			return false;
+		}
+		value = value * 10 + (s.ptr[i] - '0');
+	}
+	*n = value;
+	return true;
+}
+
+Slice trim_spaces(Slice s) {
+	while (s.len > 0 && (s.ptr[0] == ' ' || s.ptr[0] == '\t')) {
+		s = slice_advanced(s, 1);
+	}
+	while (s.len > 0 && (s.ptr[s.len - 1] == ' ' || s.ptr[s.len - 1] == '\t')) {
+		s.len -= 1;
+	}
+
+	return s;
+}
+
+/*
+ * Parses "bytes=0-99, 200-, -50" (RFC 9110 14.2) against a file of `size` bytes. Returns the number of
+ * satisfiable ranges, 0 if none is (416) or -1 if the header must be ignored (malformed, too many ranges).
+ */
+int parse_byte_ranges(Slice header, size_t size, ByteRange ranges[MAX_BYTE_RANGES]) {
+	if (header.len < 6 || !slice_equal_nocase((Slice) { .ptr = header.ptr, .len = 6 }, slice_bytes("bytes="))) {
+		return -1;
+	}
+	header = slice_advanced(header, 6);
+
+	int n = 0, nspecs = 0;
+	while (header.len > 0) {
+		size_t comma = slice_cspn(header, ",");
+		Slice spec = trim_spaces((Slice) { .ptr = header.ptr, .len = comma });
+		header = slice_advanced(header, comma < header.len ? comma + 1 : comma);
+		if (spec.len == 0) {
+			continue;
+		}
+		if (++nspecs > MAX_BYTE_RANGES) {
+			return -1;
+		}
+
+		size_t dash = slice_cspn(spec, "-");
+		if (dash == spec.len) {
+			return -1;
+		}
+		Slice first = { .ptr = spec.ptr, .len = dash };
+		Slice last = slice_advanced(spec, dash + 1);
+
+		size_t start = 0, end = 0;
+		if (first.len == 0) {
+			// suffix range, the last `end` bytes
+			if (!parse_decimal(last, &end)) {
+				return -1;
+			}
+			if (end == 0 || size == 0) {
+				continue;
+			}
+			start = end < size ? size - end : 0;
+			end = size - 1;
+		}
+		else {
+			if (!parse_decimal(first, &start)) {
+				return -1;
+			}
+			end = size - 1;
+			if (last.len > 0) {
+				if (!parse_decimal(last, &end) || end < start) {
+					return -1;
+				}
+				if (end >= size) {
+					end = size - 1;
+				}
+			}
+			if (start >= size) {
+				continue;
+			}
+		}
+		ranges[n++] = (ByteRange) { .start = start, .len = end - start + 1 };
+	}
+
+	return nspecs == 0 ? -1 : n;
+}
+
+/*
+ * Sorts the ranges and coalesces the overlapping or adjacent ones (RFC 9110 14.3), returns how many are
+ * left. -1 if they ask for more bytes than the file has, the header is then ignored.
+ */
+int merge_byte_ranges(ByteRange *ranges, int n, size_t size) {
+	size_t total = 0;
+	for (int i = 0; i < n; i++) {
+		total += ranges[i].len;
+		if (total > size) {
+			return -1;
+		}
+	}
+
+	for (int i = 1; i < n; i++) {
+		ByteRange range = ranges[i];
+		int j = i;
+		for (; j > 0 && ranges[j - 1].start > range.start; j--) {
+			ranges[j] = ranges[j - 1];
+		}
+		ranges[j] = range;
+	}
+
+	int merged = 0;
+	for (int i = 0; i < n; i++) {
+		if (merged > 0 && ranges[i].start <= ranges[merged - 1].start + ranges[merged - 1].len) {
+			ByteRange *last = &ranges[merged - 1];
+			size_t end = ranges[i].start + ranges[i].len;
+			if (end > last->start + last->len) {
+				last->len = end - last->start;
+			}
+			continue;
+		}
+		ranges[merged++] = ranges[i];
+	}
+
+	return merged;
+}
+
+#define VALIDATOR_LEN 64
+
+// Strong ETag (size and modification time) and Last-Modified date of a file
+void file_validators(const struct stat *st, char etag[VALIDATOR_LEN], char last_modified[VALIDATOR_LEN]) {
+	snprintf(etag, VALIDATOR_LEN, "\"%lx-%lx\"", (unsigned long) st->st_size,
+		(unsigned long) st->st_mtim.tv_sec * 1000000000UL + st->st_mtim.tv_nsec);
+	struct tm tm;
+	strftime(last_modified, VALIDATOR_LEN, "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&st->st_mtim.tv_sec, &tm));
+}
+
+// If-None-Match (weak comparison, takes precedence) or If-Modified-Since says the client's copy is current
+bool not_modified(Context *ctx, const char *etag, time_t mtime) {
+	Request *req = ctx->request;
+	if (req->method_type != METHOD_GET && req->method_type != METHOD_HEAD) {
+		return false;
+	}
+
+	Slice if_none_match = request_known_header(req, HEADER_IF_NONE_MATCH);
+	if (if_none_match.ptr != NULL) {
+		Slice own = slice_cstr(etag);
+		while (if_none_match.len > 0) {
+			size_t comma = slice_cspn(if_none_match, ",");
+			Slice tag = trim_spaces((Slice) { .ptr = if_none_match.ptr, .len = comma });
+			if_none_match = slice_advanced(if_none_match, comma < if_none_match.len ? comma + 1 : comma);
+			if (tag.len >= 2 && tag.ptr[0] == 'W' && tag.ptr[1] == '/') {
+				tag = slice_advanced(tag, 2);
+			}
+			if (slice_equal_cstr(tag, "*") || slice_equal(tag, own)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	Slice if_modified_since = request_known_header(req, HEADER_IF_MODIFIED_SINCE);
+	if (if_modified_since.ptr == NULL || if_modified_since.len >= VALIDATOR_LEN) {
+		return false;
+	}
+	char date[VALIDATOR_LEN] = {0};
+	memcpy(date, if_modified_since.ptr, if_modified_since.len);
+	struct tm tm = {0};
+	const char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	return end != NULL && *end == '\0' && mtime <= timegm(&tm);
+}
+
+/*
+ * A multipart boundary for one response, so a file can't contain it by design: the ETag hashed (FNV-1a)
+ * with a random nonce, or a counter when the kernel has no randomness to give
+ */
+void byteranges_boundary(const char *etag, char boundary[BYTERANGES_BOUNDARY_LEN]) {
+	static unsigned long long counter = 0;
+	unsigned long long nonce = 0;
+	if (getrandom(&nonce, sizeof(nonce), GRND_NONBLOCK) != sizeof(nonce)) {
+		nonce = __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+	}
+
+	unsigned long long hash = 14695981039346656037ULL;
+	for (const char *p = etag; *p != '\0'; p++) {
+		hash = (hash ^ (unsigned char) *p) * 1099511628211ULL;
+	}
+	snprintf(boundary, BYTERANGES_BOUNDARY_LEN, "CERVER-%016llx%016llx", hash, nonce);
+}
+
+/*
+ * Answers with a regular file, along with its validators (ETag, Last-Modified). A GET with a Range header
+ * gets 206 and only the requested spans (one is sent with sendfile, several as multipart/byteranges read
+ * with pread up to MAX_BYTERANGES_LEN), or 416 when none is satisfiable. Overlapping spans are merged,
+ * spans adding up to more than the file get the whole file. If-Range falls back to it as well when stale.
+ * Takes `file`.
+ */
+void file_response(Context *ctx, int status_code, int file, const struct stat *st, const char *content_type) {
+	size_t size = st->st_size;
+	char etag[VALIDATOR_LEN], last_modified[VALIDATOR_LEN];
+	file_validators(st, etag, last_modified);
+
+	ctx->status_code = status_code;
 	set_response_header(ctx, "Content-Type", "%s", content_type);
+	set_response_header(ctx, "ETag", "%s", etag);
+	set_response_header(ctx, "Last-Modified", "%s", last_modified);
+	set_response_header(ctx, "Accept-Ranges", "bytes");
+	if (status_code == 200 && not_modified(ctx, etag, st->st_mtim.tv_sec)) {
+		ctx->status_code = 304;
+		close(file);
+		return;
+	}
+
+	Request *req = ctx->request;
+	Slice range = request_known_header(req, HEADER_RANGE);
+	Slice if_range = request_known_header(req, HEADER_IF_RANGE);
+	if (status_code != 200 || range.ptr == NULL || req->method_type != METHOD_GET ||
+			(if_range.ptr != NULL && !slice_equal_cstr(if_range, etag) && !slice_equal_cstr(if_range, last_modified))) {
+		response_file(ctx, file, 0, size);
+		return;
+	}
+
+	ByteRange ranges[MAX_BYTE_RANGES];
+	int nranges = parse_byte_ranges(range, size, ranges);
+	if (nranges > 0) {
+		nranges = merge_byte_ranges(ranges, nranges, size);
+	}
+	size_t parts_len = 0;
+	for (int i = 0; nranges > 1 && i < nranges; i++) {
+		parts_len += ranges[i].len;
+	}
+	if (nranges < 0 || parts_len > MAX_BYTERANGES_LEN) {
+		response_file(ctx, file, 0, size);
+		return;
+	}
+	if (nranges == 0) {
+		ctx->status_code = 416;
+		set_response_header(ctx, "Content-Range", "bytes */%ld", size);
+		close(file);
+		return;
+	}
+
+	ctx->status_code = 206;
+	if (nranges == 1) {
+		set_response_header(ctx, "Content-Range", "bytes %ld-%ld/%ld", ranges[0].start, ranges[0].start + ranges[0].len - 1, size);
+		response_file(ctx, file, ranges[0].start, ranges[0].len);
+		return;
+	}
+
+	char boundary[BYTERANGES_BOUNDARY_LEN];
+	byteranges_boundary(etag, boundary);
+	GString *body = &ctx->response->body;
+	for (int i = 0; i < nranges; i++) {
+		gstr_append_fmt(body, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+			boundary, content_type, ranges[i].start, ranges[i].start + ranges[i].len - 1, size);
+		ssize_t n = gstr_reserve(body, ranges[i].len) ? pread(file, body->ptr + body->len, ranges[i].len, ranges[i].start) : -1;
+		if (n != (ssize_t) ranges[i].len) {
+			ctx->status_code = 503;
+			gstr_clear(body);
+			break;
+		}
+		body->len += n;
+	}
+	if (ctx->status_code == 206) {
+		gstr_append_fmt(body, "\r\n--%s--\r\n", boundary);
+		set_response_header(ctx, "Content-Type", "multipart/byteranges; boundary=%s", boundary);
+	}
+	close(file);
 }
+#endif
 
 void stream(Context *ctx, int status_code, const char *content_type, FILE *f) {
 	ctx->status_code = status_code;
 
 	ctx->response->body.len = 0;
+	shashmap_clear(&ctx->response->headers);
+#ifdef linux
+	// the caller keeps `f`, the response sends a duplicate of its descriptor
+	int file = f != NULL ? dup(fileno(f)) : -1;
+	struct stat st;
+	if (file != -1 && regular_file(file, &st)) {
+		file_response(ctx, status_code, file, &st, content_type);
+		return;
+	}
+	if (file != -1) {
+		close(file);
+	}
+#endif
 	gstr_append_fmt(&ctx->response->body, "%F", f);
-
-	ctx->response->headers.len = 0;
 	set_response_header(ctx, "Content-Type", "%s", content_type);
 }
 
 void file(Context *ctx, int status_code, const char *filepath) {
 	ctx->response->body.len = 0;
-	ctx->response->headers.len = 0;
-
-	FILE *f = fopen(filepath, "rb");
-	if (f == NULL) {
-		ctx->status_code = 404;
-		return;
-	}
-	ctx->status_code = status_code;
+	shashmap_clear(&ctx->response->headers);
 
 	const char *filename = strrchr(filepath, '/');
 	if (filename == NULL) {
@@ -119,18 +447,43 @@ void file(Context *ctx, int status_code, const char *filepath) {
 		filename += 1;
 	}
 
+#ifdef linux
+	// only the first MIME_SNIFF_LEN bytes are read here, the content is sent with sendfile
+	int file = open(filepath, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (file == -1 || !regular_file(file, &st)) {
+		if (file != -1) {
+			close(file);
+		}
+		ctx->status_code = 404;
+		return;
+	}
+
+	char head[MIME_SNIFF_LEN + 1] = {0};
+	ssize_t head_len = pread(file, head, MIME_SNIFF_LEN, 0);
+	const char *content_type = find_file_mime((Slice) { .ptr = head, .len = head_len > 0 ? head_len : 0 }, st.st_size);
+	set_response_header(ctx, "Content-Disposition", "attachment; filename=\"%s\"", filename);
+	file_response(ctx, status_code, file, &st, content_type);
+#else
+	FILE *f = fopen(filepath, "rb");
+	if (f == NULL) {
+		ctx->status_code = 404;
+		return;
+	}
+	ctx->status_code = status_code;
+
 	gstr_append_fmt(&ctx->response->body, "%F", f);
+	fclose(f);
 
 	const char *content_type = find_mime((Slice) { .ptr = ctx->response->body.ptr, .len = ctx->response->body.len });
 	set_response_header(ctx, "Content-Type", "%s", content_type);
 	set_response_header(ctx, "Content-Disposition", "attachment; filename=\"%s\"", filename);
-
-	fclose(f);
+#endif
 }
 
 void redirect(Context *ctx, int status_code, const char *url) {
 	ctx->status_code = status_code;
-	ctx->response->headers.len = 0;
+	shashmap_clear(&ctx->response->headers);
 	set_response_header(ctx, "Location", url);
 }
 
@@ -158,78 +511,71 @@ bool send_cstr(int fd, const char *cstr, size_t len) {
 	return true;
 }
 
-bool send_vfmt(int fd, const char *fmt, va_list arg) {
-	size_t pos = strcspn(fmt, "%");
-	bool success = true;
-	GString arena = {0};
-
-	while (fmt[pos] != '\0') {
-		if (pos > 0) {
-			success &= send_cstr(fd, fmt, pos);
+// Sends `a` then `b` with as few syscalls as the socket allows (one writev on linux)
+bool send_parts(int fd, const char *a, size_t alen, const char *b, size_t blen) {
+#ifdef linux
+	while (alen + blen > 0) {
+		struct iovec iov[2] = {
+			{ .iov_base = (void*) a, .iov_len = alen },
+			{ .iov_base = (void*) b, .iov_len = blen },
+		};
+		struct msghdr msg = {
+			.msg_iov = alen > 0 ? iov : iov + 1,
+			.msg_iovlen = alen > 0 ? 2 : 1,
+		};
+		ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (sent == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
 		}
-		fmt += pos + 1;
 
-		switch(*fmt) {
-			case '%': {
-				fmt++;
-				success &= send_cstr(fd, "%", 1);
-				break;
-			}
-			case 's': {
-				fmt++;
-				char *cs = va_arg(arg, char*);
-				if (cs != NULL) {
-					success &= send_cstr(fd, cs, 0);
-				}
-				break;
-			}
-			case 'l': {
-				fmt++;
-				if (*fmt == 'd') {
-					fmt++;
-					size_t n = va_arg(arg, size_t);
-					gstr_clear(&arena);
-					gstr_append_uint(&arena, n);
-					success &= send_cstr(fd, arena.ptr, arena.len);
-				}
-				break;
-			}
-			case 'd': {
-				fmt++;
-				int n = va_arg(arg, int);
-				gstr_clear(&arena);
-				gstr_append_int(&arena, n);
-				success &= send_cstr(fd, arena.ptr, arena.len);
-				break;
-			}
-			case 'S': {
-				fmt++;
-				if (*fmt == 'l') {
-					fmt++;
-					Slice sl = va_arg(arg, Slice);
-					if (sl.ptr != NULL && sl.len > 0) {
-						success &= send_cstr(fd, sl.ptr, sl.len);
-					}
-				}
-				else if (*fmt == 'g') {
-					fmt++;
-					GString gstr = va_arg(arg, GString);
-					if (gstr.ptr != NULL && gstr.len > 0) {
-						success &= send_cstr(fd, gstr.ptr, gstr.len);
-					}
-				}
-				break;
-			}
+		size_t n = sent;
+		if (n >= alen) {
+			b += n - alen;
+			blen -= n - alen;
+			alen = 0;
 		}
+		else {
+			a += n;
+			alen -= n;
+		}
+	}
 
-		if (!success) {
-			return false;
+	return true;
+#else
+	return (alen == 0 || send_cstr(fd, a, alen)) && (blen == 0 || send_cstr(fd, b, blen));
+#endif
+}
+
+#ifdef linux
+#define SENDFILE_CHUNK (1 << 20)
+
+// Blocking sendfile of `len` bytes of `file` from `offset`, at most SENDFILE_CHUNK per call
+bool send_file(int fd, int file, size_t offset, size_t len) {
+	off_t off = offset;
+	while (len > 0) {
+		ssize_t sent = sendfile(fd, file, &off, len < SENDFILE_CHUNK ? len : SENDFILE_CHUNK);
+		if (sent == -1 && errno == EINTR) {
+			continue;
+		}
+		if (sent <= 0) {
+			return false;		// error or the file was truncated
 		}
-		pos = strcspn(fmt, "%");
+		len -= sent;
 	}
-	gstr_free(&arena);
 
-	success &= send_cstr(fd, fmt, 0);
+	return true;
+}
+#endif
+
+// Formats the whole message first, so it goes out in one send
+bool send_vfmt(int fd, const char *fmt, va_list arg) {
+	GString arena = {0};
+	gstr_append_vfmt(&arena, fmt, arg);
+	bool success = arena.len == 0 || send_cstr(fd, arena.ptr, arena.len);
+	gstr_free(&arena);
 
 	return success;
 }
@@ -243,11 +589,9 @@ bool send_fmt(int fd, const char *fmt, ...) {
 	return success;
 }
 
-bool send_response(Context *ctx) {
-	bool success = true;
-	GString arena = {0};
-	strput_httpstatus(&arena, ctx->status_code);
-	success &= send_fmt(ctx->client, "%Sg", arena);
+// Status line, headers and Content-Length, everything but the body
+size_t strput_response_head(GString *s, Context *ctx) {
+	size_t len = strput_httpstatus(s, ctx->status_code);
 
 	if (!shashmap_empty(&ctx->response->headers)) {
 		for (size_t slot_idx = 0; slot_idx < ctx->response->headers.capacity; slot_idx++) {
@@ -255,19 +599,59 @@ bool send_response(Context *ctx) {
 				size_t idx = ctx->response->headers.link[slot_idx];
 				GString key = ctx->response->headers.key[idx];
 				GString value = ctx->response->headers.value[idx];
-				success &= send_fmt(ctx->client, "%Sg: %Sg\r\n", key, value);
+				len += gstr_append_fmt(s, "%Sg: %Sg\r\n", key, value);
 			}
 		}
 	}
 
-	gstr_clear(&arena);
-	gstr_append_fmt(&arena, "%ld", ctx->response->body.len);
-	success &= send_fmt(ctx->client, "Content-Length: %Sg\r\n\r\n", arena);
-	if (ctx->response->body.len > 0) {
-		success &= send_fmt(ctx->client, "%Sg\r\n", ctx->response->body);
+	if (ctx->status_code == 304) {
+		return len + gstr_append_fmt(s, "\r\n");	// no body, and no length to announce for it
 	}
+	Response *resp = ctx->response;
+	len += gstr_append_fmt(s, "Content-Length: %ld\r\n\r\n", resp->body.len + resp->shared.data.len + resp->file_len);
+	return len;
+}
 
-	gstr_free(&arena);
+size_t strput_response(GString *s, Context *ctx) {
+	size_t len = strput_response_head(s, ctx);
+	Response *resp = ctx->response;
+	len += gstr_append_fmt(s, "%Sg", resp->body);
+	if (resp->shared.data.len > 0) {
+		len += gstr_append_cstr(s, resp->shared.data.ptr, resp->shared.data.len);
+	}
+#ifdef linux
+	if (resp->file_len > 0 && gstr_reserve(s, resp->file_len)) {
+		size_t done = 0;
+		while (done < resp->file_len) {
+			ssize_t n = pread(resp->file, s->ptr + s->len + done, resp->file_len - done, resp->file_offset + done);
+			if (n <= 0) {
+				break;
+			}
+			done += n;
+		}
+		s->len += done;
+		len += done;
+	}
+#endif
+
+	return len;
+}
+
+// The head is serialized into one buffer and sent together with the body
+bool send_response(Context *ctx) {
+	GString head = {0};
+	strput_response_head(&head, ctx);
+	Response *resp = ctx->response;
+	bool success = send_parts(ctx->client, head.ptr, head.len, resp->body.ptr, resp->body.len);
+	gstr_free(&head);
+	if (success && resp->shared.data.len > 0) {
+		success = send_parts(ctx->client, resp->shared.data.ptr, resp->shared.data.len, NULL, 0);
+	}
+#ifdef linux
+	if (success && resp->file_len > 0) {
+		success = send_file(ctx->client, resp->file, resp->file_offset, resp->file_len);
+	}
+#endif
 
 	return success;
 }
@@ -0,0 +1,554 @@
+#ifndef URING_H
+#define URING_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define URING_ENTRIES 1024
+#define URING_NBUFS 512					// provided receive buffers, must be a power of two
+#define URING_BUF_LEN 4096
+#define URING_BUF_GROUP 0
+#define URING_FILE_CHUNK (REQUEST_RETAIN_LEN - 1)	// io_uring has no sendfile, files are read into conn->body in chunks
+												// this size, so the buffer and its terminator outlive trim_gstr()
+
+enum {
+	URING_ACCEPT = 1,
+	URING_RECV,
+	URING_SEND,
+	URING_READ,
+	URING_TICK,
+	URING_CANCEL,
+};
+#define URING_OP_MASK 7					// user_data = Connection* | op, connections are at least 8-byte aligned
+
+typedef struct {
+	int fd;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sq_entries;
+	unsigned unsubmitted;
+	struct io_uring_sqe *sqes;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	size_t sqes_len;
+
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_len;
+	char *bufs;
+
+	size_t inflight;					// submitted operations that will still post a completion
+} Uring;
+
+int uring_enter(Uring *ring, unsigned to_submit, unsigned min_complete) {
+	unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+	return (int) syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+void uring_free(Uring *ring) {
+	if (ring->buf_ring != NULL) {
+		munmap(ring->buf_ring, ring->buf_ring_len);
+	}
+	free(ring->bufs);
+	if (ring->sqes != NULL) {
+		munmap(ring->sqes, ring->sqes_len);
+	}
+	if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr) {
+		munmap(ring->cq_ptr, ring->cq_len);
+	}
+	if (ring->sq_ptr != NULL) {
+		munmap(ring->sq_ptr, ring->sq_len);
+	}
+	if (ring->fd > 0) {
+		close(ring->fd);
+	}
+	*ring = (Uring) {0};
+}
+
+// Hands a receive buffer (back) to the kernel
+void uring_provide_buffer(Uring *ring, unsigned short bid) {
+	struct io_uring_buf_ring *br = ring->buf_ring;
+	unsigned short tail = br->tail;
+	struct io_uring_buf *buf = &br->bufs[tail & (URING_NBUFS - 1)];
+	buf->addr = (uintptr_t) (ring->bufs + (size_t) bid * URING_BUF_LEN);
+	buf->len = URING_BUF_LEN;
+	buf->bid = bid;
+	__atomic_store_n(&br->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
+
+// Returns false if the kernel lacks io_uring or provided buffer rings (< 5.19)
+bool uring_init(Uring *ring) {
+	struct io_uring_params p = {0};
+	ring->fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ring->fd < 0) {
+		ring->fd = 0;
+		return false;
+	}
+
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap && ring->cq_len > ring->sq_len) {
+		ring->sq_len = ring->cq_len;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		ring->sq_ptr = NULL;
+		uring_free(ring);
+		return false;
+	}
+	if (single_mmap) {
+		ring->cq_ptr = ring->sq_ptr;
+	}
+	else {
+		ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			ring->cq_ptr = NULL;
+			uring_free(ring);
+			return false;
+		}
+	}
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		uring_free(ring);
+		return false;
+	}
+
+	char *sq = ring->sq_ptr, *cq = ring->cq_ptr;
+	ring->sq_head = (unsigned*) (sq + p.sq_off.head);
+	ring->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned*) (sq + p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+	ring->cq_head = (unsigned*) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+	ring->buf_ring_len = URING_NBUFS * sizeof(struct io_uring_buf);
+	ring->buf_ring = mmap(NULL, ring->buf_ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ring->bufs = malloc((size_t) URING_NBUFS * URING_BUF_LEN);
+	if (ring->buf_ring == MAP_FAILED || ring->bufs == NULL) {
+		if (ring->buf_ring == MAP_FAILED) {
+			ring->buf_ring = NULL;
+		}
+		uring_free(ring);
+		return false;
+	}
+
+	struct io_uring_buf_reg reg = {
+		.ring_addr = (uintptr_t) ring->buf_ring,
+		.ring_entries = URING_NBUFS,
+		.bgid = URING_BUF_GROUP,
+	};
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+		uring_free(ring);
+		return false;
+	}
+	for (unsigned short bid = 0; bid < URING_NBUFS; bid++) {
+		uring_provide_buffer(ring, bid);
+	}
+
+	return true;
+}
+
+bool uring_submit(Uring *ring) {
+	while (ring->unsubmitted > 0) {
+		int submitted = uring_enter(ring, ring->unsubmitted, 0);
+		if (submitted < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		ring->unsubmitted -= submitted;
+	}
+
+	return true;
+}
+
+// Without SQPOLL the kernel only reads the queue in io_uring_enter, so the entry is published right away
+struct io_uring_sqe *uring_get_sqe(Uring *ring, int opcode, int fd, uint64_t user_data) {
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *ring->sq_tail;
+	if (tail - head >= ring->sq_entries) {
+		uring_submit(ring);
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head >= ring->sq_entries) {
+			return NULL;
+		}
+	}
+
+	unsigned idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = user_data;
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->unsubmitted += 1;
+	if (opcode != IORING_OP_ASYNC_CANCEL) {
+		ring->inflight += 1;
+	}
+
+	return sqe;
+}
+
+bool uring_arm_accept(Uring *ring, int server) {
+	struct io_uring_sqe *sqe = uring_get_sqe(ring, IORING_OP_ACCEPT, server, URING_ACCEPT);
+	if (sqe == NULL) {
+		return false;
+	}
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	return true;
+}
+
+bool uring_arm_recv(Uring *ring, Connection *conn) {
+	struct io_uring_sqe *sqe = uring_get_sqe(ring, IORING_OP_RECV, conn->client, (uintptr_t) conn | URING_RECV);
+	if (sqe == NULL) {
+		return false;
+	}
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUF_GROUP;
+	conn->recv_armed = true;
+	return true;
+}
+
+bool uring_arm_tick(Uring *ring, struct __kernel_timespec *ts) {
+	struct io_uring_sqe *sqe = uring_get_sqe(ring, IORING_OP_TIMEOUT, -1, URING_TICK);
+	if (sqe == NULL) {
+		return false;
+	}
+	sqe->addr = (uintptr_t) ts;
+	sqe->len = 1;
+	return true;
+}
+
+void uring_cancel(Uring *ring, uint64_t user_data) {
+	struct io_uring_sqe *sqe = uring_get_sqe(ring, IORING_OP_ASYNC_CANCEL, -1, URING_CANCEL);
+	if (sqe != NULL) {
+		sqe->addr = user_data;
+	}
+}
+
+// The connection is freed once the kernel gave back every operation that references it
+void uring_close_connection(ConnectionList *list, Connection *conn) {
+	if (!conn->closing) {
+		conn->closing = true;
+		connection_list_remove(list, conn);
+		shutdown(conn->client, SHUT_RDWR);	// completes the pending recv
+	}
+	if (conn->recv_armed || conn->send_armed || conn->read_armed) {
+		return;
+	}
+
+	close(conn->client);
+	free_connection(conn);
+	free(conn);
+}
+
+// Queues the read of the next chunk of the response file into conn->body, once output and body were sent
+bool uring_read_file(Uring *ring, Connection *conn) {
+	size_t chunk = conn->file_len < URING_FILE_CHUNK ? conn->file_len : URING_FILE_CHUNK;
+	if (!gstr_reserve_exact(&conn->body, chunk)) {
+		return false;
+	}
+
+	struct io_uring_sqe *sqe = uring_get_sqe(ring, IORING_OP_READ, conn->file, (uintptr_t) conn | URING_READ);
+	if (sqe == NULL) {
+		return false;
+	}
+	sqe->addr = (uintptr_t) conn->body.ptr;
+	sqe->len = chunk;
+	sqe->off = conn->file_offset;
+	conn->read_armed = true;
+	return true;
+}
+
+/*
+ * Answers the buffered requests, the response is sent with the next recv linked behind it so
+ * both go to the kernel in one submission and the recv only starts once the response is out.
+ */
+void uring_continue(Cerver *c, Uring *ring, ConnectionList *list, Connection *conn) {
+	if (conn->send_armed || conn->read_armed) {
+		return;
+	}
+
+	answer_buffered_requests(c, conn);
+	if (conn->detach) {
+		// the recv would race the handler for the body, the connection moves once the kernel gave it back
+		if (conn->recv_armed) {
+			uring_cancel(ring, (uintptr_t) conn | URING_RECV);
+			return;
+		}
+		connection_list_remove(list, conn);
+		detach_connection(c, conn);
+		return;
+	}
+
+	bool reading = !conn->eof && (conn->nrequests == 0 || conn->keep_alive);
+	if (connection_pending(conn) > 0) {
+		if (connection_iov(conn, conn->iov) == 0) {
+			if (!uring_read_file(ring, conn)) {
+				uring_close_connection(list, conn);
+			}
+			return;		// sent once the chunk is read
+		}
+
+		struct io_uring_sqe *sqe = uring_get_sqe(ring, IORING_OP_SENDMSG, conn->client, (uintptr_t) conn | URING_SEND);
+		if (sqe == NULL) {
+			uring_close_connection(list, conn);
+			return;
+		}
+		conn->msg = (struct msghdr) { .msg_iov = conn->iov, .msg_iovlen = connection_iov(conn, conn->iov) };
+		sqe->addr = (uintptr_t) &conn->msg;
+		sqe->len = 1;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		conn->send_armed = true;
+
+		if (reading && !conn->recv_armed) {
+			sqe->flags |= IOSQE_IO_LINK;
+			uring_arm_recv(ring, conn);
+		}
+		return;
+	}
+
+	// unread input is drained after the last response, see connection_drain()
+	if (!reading && !conn->eof && (conn->draining || conn->input.len > 0)) {
+		if (!conn->draining) {
+			conn->draining = true;
+			gstr_clear(&conn->input);
+			shutdown(conn->client, SHUT_WR);
+		}
+		if (!conn->recv_armed && !uring_arm_recv(ring, conn)) {
+			uring_close_connection(list, conn);
+		}
+	}
+	else if (!reading) {
+		uring_close_connection(list, conn);
+	}
+	else if (!conn->recv_armed && !uring_arm_recv(ring, conn)) {
+		uring_close_connection(list, conn);
+	}
+}
+
+void uring_accepted(Uring *ring, ConnectionList *list, int client) {
+	Connection *conn = calloc(1, sizeof(Connection));
+	if (conn == NULL) {
+		close(client);
+		return;
+	}
+	conn->client = client;
+	conn->last_active = monotonic_ms();
+	connection_list_push(list, conn);
+
+	if (!uring_arm_recv(ring, conn)) {
+		uring_close_connection(list, conn);
+	}
+}
+
+void uring_received(Cerver *c, Uring *ring, ConnectionList *list, Connection *conn, struct io_uring_cqe *cqe) {
+	conn->recv_armed = false;
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if (cqe->res > 0 && !conn->closing && !conn->draining) {
+			size_t room = request_read_len(&conn->input, request_missing(c, conn, 0));
+			gstr_reserve_exact(&conn->input, room > (size_t) cqe->res ? room : (size_t) cqe->res);
+			gstr_append_cstr(&conn->input, ring->bufs + (size_t) bid * URING_BUF_LEN, cqe->res);
+		}
+		uring_provide_buffer(ring, bid);
+	}
+
+	if (conn->closing) {
+		uring_close_connection(list, conn);
+		return;
+	}
+	if (cqe->res == -ENOBUFS || cqe->res == -ECANCELED) {
+		uring_continue(c, ring, list, conn);	// every buffer was taken or a short send broke the link, try again
+		return;
+	}
+	if (cqe->res < 0) {
+		uring_close_connection(list, conn);
+		return;
+	}
+	if (cqe->res == 0) {
+		conn->eof = true;
+	}
+
+	if (!conn->draining) {
+		conn->last_active = monotonic_ms();
+		connection_list_remove(list, conn);
+		connection_list_push(list, conn);
+	}
+	uring_continue(c, ring, list, conn);
+}
+
+void uring_file_read(Cerver *c, Uring *ring, ConnectionList *list, Connection *conn, struct io_uring_cqe *cqe) {
+	conn->read_armed = false;
+	if (conn->closing || cqe->res <= 0) {
+		uring_close_connection(list, conn);	// error or the file was truncated
+		return;
+	}
+
+	conn->body.len = cqe->res;
+	connection_file_sent(conn, cqe->res);
+	uring_continue(c, ring, list, conn);
+}
+
+void uring_sent(Cerver *c, Uring *ring, ConnectionList *list, Connection *conn, struct io_uring_cqe *cqe) {
+	conn->send_armed = false;
+	if (conn->closing || cqe->res <= 0) {
+		uring_close_connection(list, conn);
+		return;
+	}
+
+	connection_sent(conn, cqe->res);
+	uring_continue(c, ring, list, conn);
+}
+
+/*
+ * io_uring backend: multishot accept, recv into a ring of provided buffers and linked send + recv.
+ * Every loop iteration is a single io_uring_enter that submits the queued operations and waits for
+ * completions. Like the event loop, handlers run on this thread, streaming routes move their connection to one.
+ */
+bool run_uring(Cerver *c, Uring *ring, int server) {
+	ConnectionList list = {0};
+	struct __kernel_timespec tick = { .tv_sec = 1 };
+	long long idle_timeout = keep_alive_timeout(c) * 1000LL;
+
+	if (!uring_arm_accept(ring, server) || !uring_arm_tick(ring, &tick)) {
+		uring_free(ring);
+		return false;
+	}
+
+	bool stop = false;
+	while (!stop) {
+		int submitted = uring_enter(ring, ring->unsubmitted, 1);
+		if (submitted < 0) {
+			if (errno != EINTR) {
+				break;
+			}
+		}
+		else {
+			ring->unsubmitted -= submitted;
+		}
+		if (c->server == -1) {
+			break;
+		}
+
+		unsigned head = *ring->cq_head;
+		unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			Connection *conn = (Connection*) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_OP_MASK);
+			int op = cqe->user_data & URING_OP_MASK;
+			if (op != URING_CANCEL && !(cqe->flags & IORING_CQE_F_MORE)) {
+				ring->inflight -= 1;
+			}
+
+			switch (op) {
+				case URING_ACCEPT: {
+					if (cqe->res >= 0) {
+						uring_accepted(ring, &list, cqe->res);
+					}
+					if (!(cqe->flags & IORING_CQE_F_MORE)) {
+						stop = c->server == -1 || !uring_arm_accept(ring, server);
+					}
+					break;
+				}
+				case URING_RECV: {
+					uring_received(c, ring, &list, conn, cqe);
+					break;
+				}
+				case URING_SEND: {
+					uring_sent(c, ring, &list, conn, cqe);
+					break;
+				}
+				case URING_READ: {
+					uring_file_read(c, ring, &list, conn, cqe);
+					break;
+				}
+				case URING_TICK: {
+					long long now = monotonic_ms();
+					while (list.head != NULL && now - list.head->last_active >= idle_timeout) {
+						uring_close_connection(&list, list.head);
+					}
+					uring_arm_tick(ring, &tick);
+					break;
+				}
+			}
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	// cancel the listener and the tick, shut every connection down and wait for the kernel to let go of them
+	uring_cancel(ring, URING_ACCEPT);
+	uring_cancel(ring, URING_TICK);
+	while (list.head != NULL) {
+		uring_close_connection(&list, list.head);
+	}
+	while (ring->inflight > 0) {
+		int submitted = uring_enter(ring, ring->unsubmitted, 1);
+		if (submitted < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		ring->unsubmitted -= submitted;
+
+		unsigned head = *ring->cq_head;
+		unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			Connection *conn = (Connection*) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_OP_MASK);
+			int op = cqe->user_data & URING_OP_MASK;
+			if (op != URING_CANCEL && !(cqe->flags & IORING_CQE_F_MORE)) {
+				ring->inflight -= 1;
+			}
+			if (op == URING_ACCEPT && cqe->res >= 0) {
+				close(cqe->res);
+			}
+			else if (op == URING_RECV || op == URING_SEND || op == URING_READ) {
+				if (op == URING_RECV) {
+					conn->recv_armed = false;
+					if (cqe->flags & IORING_CQE_F_BUFFER) {
+						uring_provide_buffer(ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+					}
+				}
+				else if (op == URING_SEND) {
+					conn->send_armed = false;
+				}
+				else {
+					conn->read_armed = false;
+				}
+				uring_close_connection(&list, conn);
+			}
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	uring_free(ring);
+	free_request_cache();
+	return true;
+}
+
+#endif // URING_H
@@ -0,0 +1,253 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <signal.h>
+#include <stdatomic.h>
+
+#define WORK_QUEUE_CAPACITY 1024	// must be a power of two
+
+/*
+ * Chase-Lev style ring buffer. The accept loop is the only producer and pushes at the bottom,
+ * the owning worker and the thieves all take from the top with a CAS, so connections are served
+ * in the order they were accepted.
+ */
+typedef struct {
+	_Atomic size_t top;
+	_Atomic size_t bottom;
+	_Atomic int clients[WORK_QUEUE_CAPACITY];
+
+	_Atomic size_t executed;
+	_Atomic size_t steals;		// connections this worker took from other queues
+} WorkQueue;
+
+struct WorkerPool {
+	Cerver *c;
+	WorkQueue *queues;
+	pthread_t *threads;
+	size_t nthreads;
+	size_t nworkers;
+	size_t next;				// round-robin cursor, only touched by the accept loop
+
+	_Atomic size_t pending;		// pushed but not taken yet
+	_Atomic size_t idle;
+	_Atomic size_t rejected;
+	_Atomic bool stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+};
+
+typedef struct {
+	WorkerPool *pool;
+	size_t idx;
+} WorkerInfo;
+
+size_t work_queue_depth(WorkQueue *q) {
+	size_t b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+	size_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+	return b > t ? b - t : 0;
+}
+
+bool work_queue_push(WorkQueue *q, int client) {
+	size_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+	size_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+	if (b - t >= WORK_QUEUE_CAPACITY) {
+		return false;
+	}
+
+	atomic_store_explicit(&q->clients[b & (WORK_QUEUE_CAPACITY - 1)], client, memory_order_relaxed);
+	atomic_store_explicit(&q->bottom, b + 1, memory_order_release);
+	return true;
+}
+
+int work_queue_take(WorkQueue *q) {
+	size_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+	while (1) {
+		size_t b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+		if (t >= b) {
+			return -1;
+		}
+
+		int client = atomic_load_explicit(&q->clients[t & (WORK_QUEUE_CAPACITY - 1)], memory_order_relaxed);
+		if (atomic_compare_exchange_weak_explicit(&q->top, &t, t + 1, memory_order_acq_rel, memory_order_acquire)) {
+			return client;
+		}
+	}
+}
+
+int worker_pool_take(WorkerPool *pool, size_t self) {
+	int client = work_queue_take(&pool->queues[self]);
+	if (client != -1) {
+		return client;
+	}
+
+	for (size_t i = 1; i < pool->nworkers; i++) {
+		size_t victim = (self + i) % pool->nworkers;
+		if (work_queue_depth(&pool->queues[victim]) == 0) {
+			continue;
+		}
+
+		client = work_queue_take(&pool->queues[victim]);
+		if (client != -1) {
+			atomic_fetch_add_explicit(&pool->queues[self].steals, 1, memory_order_relaxed);
+			return client;
+		}
+	}
+
+	return -1;
+}
+
+bool worker_pool_busy(WorkerPool *pool) {
+	return atomic_load(&pool->pending) > 0;
+}
+
+void *worker_main(void *arg) {
+	WorkerInfo *winfo = (WorkerInfo*) arg;
+	WorkerPool *pool = winfo->pool;
+	size_t self = winfo->idx;
+	free(winfo);
+
+	while (1) {
+		int client = worker_pool_take(pool, self);
+		if (client != -1) {
+			atomic_fetch_sub(&pool->pending, 1);
+			serve_connection(pool->c, client);
+			atomic_fetch_add_explicit(&pool->queues[self].executed, 1, memory_order_relaxed);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		atomic_fetch_add(&pool->idle, 1);
+		while (atomic_load(&pool->pending) == 0 && !atomic_load(&pool->stopping)) {
+			pthread_cond_wait(&pool->wakeup, &pool->lock);
+		}
+		atomic_fetch_sub(&pool->idle, 1);
+		pthread_mutex_unlock(&pool->lock);
+
+		if (atomic_load(&pool->stopping) && atomic_load(&pool->pending) == 0) {
+			break;
+		}
+	}
+
+	free_request_cache();
+	return NULL;
+}
+
+void reject_connection(int client, int status_code) {
+	Response resp = {0};
+	Context ctx = {
+		.client = client,
+		.status_code = status_code,
+		.response = &resp,
+	};
+	(void) send_response(&ctx);
+	close(client);
+}
+
+// Called from the accept loop only
+void worker_pool_submit(WorkerPool *pool, int client) {
+	atomic_fetch_add(&pool->pending, 1);
+	bool pushed = false;
+	for (size_t i = 0; i < pool->nworkers && !pushed; i++) {
+		pushed = work_queue_push(&pool->queues[pool->next], client);
+		pool->next = (pool->next + 1) % pool->nworkers;
+	}
+	if (!pushed) {
+		atomic_fetch_sub(&pool->pending, 1);
+		atomic_fetch_add_explicit(&pool->rejected, 1, memory_order_relaxed);
+		reject_connection(client, 503);
+		return;
+	}
+
+	if (atomic_load(&pool->idle) > 0) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_signal(&pool->wakeup);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+void free_worker_pool(WorkerPool *pool) {
+	if (pool == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	atomic_store(&pool->stopping, true);
+	pthread_cond_broadcast(&pool->wakeup);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (size_t i = 0; i < pool->nthreads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wakeup);
+	free(pool->threads);
+	free(pool->queues);
+	free(pool);
+}
+
+WorkerPool *create_worker_pool(Cerver *c, size_t nworkers) {
+	if (nworkers == 0) {
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nworkers = ncpus > 0 ? (size_t) ncpus : 1;
+	}
+
+	WorkerPool *pool = calloc(1, sizeof(WorkerPool));
+	if (pool == NULL) {
+		return NULL;
+	}
+	pool->c = c;
+	pool->queues = calloc(nworkers, sizeof(WorkQueue));
+	pool->threads = calloc(nworkers, sizeof(pthread_t));
+	if (pool->queues == NULL || pool->threads == NULL) {
+		free(pool->queues);
+		free(pool->threads);
+		free(pool);
+		return NULL;
+	}
+	pool->nworkers = nworkers;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wakeup, NULL);
+
+	// workers inherit a blocked signal mask so signals (e.g. SIGINT) keep reaching the accept loop
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (size_t i = 0; i < nworkers; i++) {
+		WorkerInfo *winfo = malloc(sizeof(WorkerInfo));
+		if (winfo == NULL) {
+			break;
+		}
+		winfo->pool = pool;
+		winfo->idx = i;
+		if (pthread_create(&pool->threads[i], NULL, worker_main, winfo) != 0) {
+			free(winfo);
+			break;
+		}
+		pool->nthreads += 1;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (pool->nthreads < nworkers) {
+		free_worker_pool(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+void print_worker_pool(WorkerPool *pool) {
+	if (pool == NULL) {
+		return;
+	}
+
+	debug("Workers: %zu, pending: %zu, idle: %zu, rejected: %zu", pool->nworkers, atomic_load(&pool->pending),
+			atomic_load(&pool->idle), atomic_load(&pool->rejected));
+	for (size_t i = 0; i < pool->nworkers; i++) {
+		WorkQueue *q = &pool->queues[i];
+		debug("  #%zu depth: %zu, executed: %zu, steals: %zu", i, work_queue_depth(q),
+				atomic_load(&q->executed), atomic_load(&q->steals));
+	}
+}
+
+#endif // WORKER_POOL_H